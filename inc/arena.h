@@ -0,0 +1,110 @@
+/*
+  Copyright (c) 2026
+  Author: agent <agent @ local>
+  Created: 2026-Oct-17 19:29 (EDT)
+  Function: bump allocator + interned strings, for the zone data
+*/
+
+#ifndef __acdns_arena_h_
+#define __acdns_arena_h_
+
+#include "defs.h"
+#include <string.h>
+
+#include <new>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+// allocations are never freed individually. everything goes
+// when the arena is deleted
+class Arena {
+    struct Ent {
+        uint32_t	hash;
+        int		len;
+        const char	*str;
+    };
+
+    vector<char*>	chunk;
+    char		*cur;
+    char		*end;
+    int64_t		total;
+
+    Ent			*itab;		// interned strings
+    uint32_t		imask;
+    uint32_t		icount;
+    bool		loading;
+
+    char *new_chunk(int);
+    void igrow(void);
+public:
+    Arena();
+    ~Arena();
+
+    void *alloc(int len){
+        len = (len + 7) & ~7;
+        if( end - cur < len ) return new_chunk(len);
+        char *p = cur;
+        cur += len;
+        return p;
+    }
+
+    const char *strdup(const char *, int);
+    const char *intern(const char *, int);
+    void done_loading(void);
+    int64_t size(void) const { return total; }
+
+private:
+    DISALLOW_COPY(Arena);
+};
+
+// a (nul terminated) string in an arena
+class AStr {
+public:
+    const char	*s;
+    int		len;
+
+    AStr(){ s = ""; len = 0; }
+    void set(Arena *a, const string &x){ s = a->intern(x.data(), x.length()); len = x.length(); }
+    void set(Arena *a, const char *x, int l){ s = a->intern(x, l); len = l; }
+
+    const char *c_str() const { return s; }
+    const char *data()  const { return s; }
+    int length()        const { return len; }
+    bool empty()        const { return !len; }
+    string str()        const { return string(s, len); }
+    char operator[](int i) const { return s[i]; }
+    int compare(const char *x) const { return strcmp(s, x); }
+    bool operator==(const string &x) const { return (int)x.length() == len && !memcmp(x.data(), s, len); }
+    bool operator==(const AStr &x)   const { return x.len == len && (x.s == s || !memcmp(x.s, s, len)); }
+};
+
+// append only array in an arena. elements are never destroyed,
+// so they must not own anything outside the arena
+template <class T> class AVec {
+    T		*v;
+    int		n;
+    int		max;
+
+public:
+    AVec(){ v = 0; n = 0; max = 0; }
+    int size()   const { return n; }
+    bool empty() const { return !n; }
+    T& operator[](int i) const { return v[i]; }
+
+    void push_back(Arena *a, const T &x){
+        if( n == max ){
+            // the old space is not reused. the arena is freed as a whole
+            max = max ? max * 2 : 2;
+            T *nv = (T*)a->alloc( max * sizeof(T) );
+            for(int i=0; i<n; i++) new (nv + i) T( v[i] );
+            v = nv;
+        }
+        new (v + n) T( x );
+        n ++;
+    }
+};
+
+
+#endif // __acdns_arena_h_
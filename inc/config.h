@@ -12,8 +12,10 @@
 
 #include <list>
 #include <string>
+#include <vector>
 using std::list;
 using std::string;
+using std::vector;
 
 
 struct sockaddr;
@@ -36,15 +38,28 @@ class Config {
 public:
     int 	udp_threads;
     int 	tcp_threads;
+    int		udp_batch;		// max datagrams per recvmmsg
+    int		udp_reuseport;		// one socket per udp thread
+    int		tcp_idle;		// close idle connections after (seconds)
+    int		tcp_maxperclient;	// max connections per client address
+    int		response_cache;		// number of cached responses
+    int		load_threads;		// parse zone files in parallel
     int 	port_console;
     int 	port_dns;
+    int		mon_timeout;		// builtin probes (seconds)
     int 	debuglevel;
     float	logpercent;
+    int		log_ring;		// queued log records, per thread
     char 	debugflags[256/8];
     char 	traceflags[256/8];
 
+    string	listen_ipv4;		// bind addresses
+    string	listen_ipv6;		// empty = no ipv6 listener
     string	datafile_ipv4;
     string	datafile_ipv6;
+    int		ipv4_index;		// build lookup index for ipv4 data
+    int		ipv6_index;		// and ipv6
+    int		location_cache;		// cached client locations, per thread
     string 	environment;
     ACL_List	acls;
     Zone_List	zones;
@@ -52,6 +67,8 @@ public:
     string	error_mailfrom;
     string	mon_path;
     string	logfile;
+    string	logformat;		// text or binary
+    vector<string> udp_cpus;		// cpu or numa node, per udp thread
 
     int check_acl(const sockaddr *);
     bool debug_is_set(int s) const { return debugflags[ s / 8 ] & (1<<(s&7)); }
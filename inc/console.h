@@ -19,6 +19,8 @@ extern void console_init(void);
 
 typedef vector<string> cmd_args;
 
+class Epoch_Slot;
+
 class Console {
 private:
     Mutex	_mutex;
@@ -29,6 +31,7 @@ private:
 public:
     string      prompt;
     int         y2_b;
+    Epoch_Slot	*epoch;		// for commands that look at the zdb
 
     Console(int);
     ~Console();
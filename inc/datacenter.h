@@ -0,0 +1,24 @@
+/*
+  Copyright (c) 2026
+  Author: agent <agent @ local>
+  Created: 2026-Oct-17 18:55 (EDT)
+  Function: datacenter names => small integer ids
+*/
+
+#ifndef __acdns_datacenter_h_
+#define __acdns_datacenter_h_
+
+#define MAXDATACENTER	64		// ids fit in a uint64_t bitmap
+
+// not real datacenters
+#define DC_NONE		-1
+#define DC_UNKNOWN	-2		// GLB:MM :unknown
+#define DC_LASTRESORT	-3		// GLB:MM :lastresort
+
+// ids are assigned when first seen, and never change or go away
+extern int  dc_register(const char *);
+extern int  dc_id(const char *);
+extern const char *dc_name(int);
+
+
+#endif // __acdns_datacenter_h_
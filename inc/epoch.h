@@ -0,0 +1,53 @@
+/*
+  Copyright (c) 2026
+  Author: agent <agent @ local>
+  Created: 2026-Oct-17 18:59 (EDT)
+  Function: epoch based reclamation of swapped out data (zdb, mmdb)
+*/
+
+#ifndef __acdns_epoch_h_
+#define __acdns_epoch_h_
+
+#include "misc.h"
+
+#define MAXEPOCHSLOT	512
+
+// one per thread that reads shared data, on its own cache line
+class Epoch_Slot {
+public:
+    volatile uint64_t	epoch;		// 0 = quiescent
+    bool		inuse;
+    char		pad[64 - sizeof(uint64_t) - sizeof(bool)];
+};
+
+class DNS_Stats;
+
+extern volatile uint64_t epoch_global;
+
+extern void epoch_init(void);
+extern Epoch_Slot *epoch_register(void);
+extern void epoch_unregister(Epoch_Slot *);
+extern void epoch_retire_fn(void (*)(void *), void *);
+extern void epoch_stats(DNS_Stats *);
+
+// readers: enter before looking at zdb, mmdb, ... leave when done
+inline void epoch_enter(Epoch_Slot *s){
+    s->epoch = epoch_global;
+    MEMBAR();
+}
+
+inline void epoch_leave(Epoch_Slot *s){
+    MEMBAR();
+    s->epoch = 0;
+}
+
+// writers: swap the pointer, then retire the old one.
+// it is deleted once no reader can still see it
+template <class T> void epoch_delete(void *p){ delete (T*)p; }
+
+template <class T> inline void epoch_retire(T *p){
+    epoch_retire_fn( epoch_delete<T>, (void*)p );
+}
+
+
+#endif // __acdns_epoch_h_
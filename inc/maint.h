@@ -10,8 +10,7 @@
 
 
 extern bool maint_set(const char *, bool);
-extern bool maint_get(const char *);
-extern void maint_register(const char *);
+extern bool maint_get(int);		// by datacenter id
 
 
 #endif // __acdns_maint_h_
@@ -27,6 +27,8 @@ inline int with_probability(float p){ return random() < p * 0x7FFFFFFF; }
 #  define ATOMIC_SET64(a,b)		((a)  = (b))
 #  define ATOMIC_ADD32(a,b)  		__sync_fetch_and_add((uint32_t*)&a, b )
 #  define ATOMIC_ADD64(a,b)  		__sync_fetch_and_add((uint64_t*)&a, b )
+#  define ATOMIC_CAS32(a,o,n)		__sync_bool_compare_and_swap((uint32_t*)&a, o, n )
+#  define MEMBAR()			__sync_synchronize()
 
 #elif defined(__sun__) || defined(__NetBSD__)
 #  include <atomic.h>
@@ -34,6 +36,9 @@ inline int with_probability(float p){ return random() < p * 0x7FFFFFFF; }
 #  define ATOMIC_SET64(a,b)		atomic_swap_64( (uint64_t*)&a, b )
 #  define ATOMIC_ADD32(a,b)		atomic_add_32(  (uint32_t*)&a, b )
 #  define ATOMIC_ADD64(a,b)		atomic_add_64(  (uint64_t*)&a, b )
+#  define ATOMIC_CAS32(a,o,n)		(atomic_cas_32( (uint32_t*)&a, o, n ) == (o))
+// full fence. epoch_enter needs store-load ordering
+#  define MEMBAR()			(membar_enter(), membar_exit(), membar_consumer())
 
 #else
 #  error "how should I do atomic ops?"
@@ -49,6 +54,12 @@ inline int with_probability(float p){ return random() < p * 0x7FFFFFFF; }
 
 #define ATOMIC_SETPTR(a,b)		((a) = (b))
 
+#ifdef __GNUC__
+#  define PREFETCH(p)			__builtin_prefetch(p)
+#else
+#  define PREFETCH(p)
+#endif
+
 
 
 #endif // __acdns_misc_h_
@@ -10,8 +10,19 @@
 
 #define MAXMMELEM	64
 
+// ipv4 index: DIR-24-8
+#define MMDIDX_CHUNK	0x80000000	// entry is an offset into idx8
+
+class MMDIdx_Build;
+class MMCache;
+class MMCache_Ent;
+
+// client location cache key: the /24 or /48 the client is in
+#define MMCACHE_BITS4	24
+#define MMCACHE_BITS6	48
+
 #define MMDDATAMAGIC    0x41436d46
-#define MMDDATAVERSION	1
+#define MMDDATAVERSION	2	// 1 = no rank
 
 class NTD;
 typedef unsigned char uchar;
@@ -40,6 +51,8 @@ public:
     int16_t		masklen;
     uint16_t		flags;
     int32_t		metric[0];	// ...
+    // v2: then uchar rank[n_datacenter], padded to 4:
+    // datacenter indexes, lowest metric first
 
 #  define MMDFREC_FLAG_UNKNOWN	1	// location unknown
 
@@ -57,27 +70,52 @@ class MMDB_File {
     int			rec_size;
     time_t		file_mtime;
     int64_t		file_inum;
+    uint32_t		gen;		// changes every load, for MMCache
 
     MMDFile_Hdr		*hdr;
     MMDFile_Rec		*rec;
 
-    const char		*dc[MAXMMELEM];
-
-    const MMDFile_Rec* best_rec(const uchar*) const;
+    int			dcid[MAXMMELEM];	// datacenter ids
+    uint64_t		dcmask;			// bit per datacenter id
+
+    // ipv4 index. entry = rec + 1, 0 = none, or MMDIDX_CHUNK | offset
+    uint32_t		*idx24;		// 2^24 entries
+    uint32_t		*idx8;		// chunks: 256 bit map + runs
+    int			n_idx8;
+
+    // ipv6 index. keys in eytzinger (bfs) order, 1 based
+    uint64_t		*ekey;
+    int			eytz_h;		// depth of the last level
+    int			eytz_l;		// nodes on the last level
+
+    const MMDFile_Rec* find_rec(const uchar*, bool *) const;
+    const MMDFile_Rec* index_rec(const uchar*) const;
+    int  eytz_upper(uint64_t) const;
+    int  rec_upper(uint64_t) const;
+    bool prefix_uniform(uint64_t, int) const;
+    bool cache_get(MMCache *, const uchar *, const MMDFile_Rec **, MMCache_Ent **) const;
+    void cache_put(MMCache *, MMCache_Ent *, const uchar *, const MMDFile_Rec *, bool) const;
+    void build_eytz(void);
+    int  eytz_fill(int, int);
+    bool rec_contains(const MMDFile_Rec *, uint64_t) const;
+    void build_index(void);
+    int  index_range(MMDIdx_Build *, uint64_t, uint64_t, uint32_t);
+    uint64_t rec_end(int) const;
     inline const MMDFile_Rec* get_rec(int n) const {
         return (MMDFile_Rec*) ((char*)rec + n * rec_size);
     }
 
 public:
     MMDB_File() {
-        map_start = 0; map_size = 0; file_size = 0; hdr = 0; rec = 0;
-        for(int i=0; i<MAXMMELEM; i++) dc[i] = 0;
+        map_start = 0; map_size = 0; file_size = 0; hdr = 0; rec = 0; gen = 0;
+        idx24 = 0; idx8 = 0; n_idx8 = 0; ekey = 0;
+        eytz_h = 0; eytz_l = 0; dcmask = 0;
     }
     ~MMDB_File();
     int  load(const char *);
     bool file_changed(const char *)     const;
     int  locate(NTD *, const uchar *)   const;
-    bool datacenter_valid(const char *) const;
+    bool datacenter_valid(int id) const { return (dcmask >> id) & 1; }
 };
 
 
@@ -98,10 +136,33 @@ public:
 
 //################################################################
 
+// in NTD: per thread, direct mapped
+class MMCache_Ent {
+public:
+    uint64_t		key;		// client prefix or addr
+    const MMDFile_Rec	*rec;		// 0 = not found
+    uint32_t		gen;		// MMDB_File::gen, 0 = empty
+    uint8_t		bits;		// key length
+    uint8_t		split;		// prefix has several answers. use the addr
+};
+
+class MMCache {
+    MMCache_Ent		*ent;
+    uint32_t		mask;
+
+public:
+    MMCache(int);
+    ~MMCache();
+    inline MMCache_Ent *get(uint64_t key, int bits) const {
+        key ^= (uint64_t)bits << 57;
+        return ent + ((uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask);
+    }
+};
+
 // in NTD:
 class MMElem {
 public:
-    const char		*datacenter;
+    int			dcid;		// DC_NONE = not usable
     int			metric;
 
     bool operator<(const MMElem& b) const { return metric < b.metric; }
@@ -114,6 +175,9 @@ public:
 #	define GLBMM_F_FAIL	2
 #	define GLBMM_F_FAILFAIL	4
 
+    const char		*datacenter;	// chosen, for the log
+
+    bool		ranked;		// mm is in metric order (v2 datafile)
     int 		nelem;
     MMElem		mm[MAXMMELEM];
 
@@ -9,14 +9,41 @@
 #define __acdns_mon_h_
 
 #include "hrtime.h"
+#include <stdint.h>
 #include <string>
 #include <vector>
 
 using std::string;
 using std::vector;
 
+// probe types. builtins run in the mon process, anything else is a script
+#define MON_EXEC	0
+#define MON_TCP		1
+#define MON_HTTP	2
+#define MON_DNS		3
+
+// probe results, in memory shared with the mon process.
+// one cache line per probe. the mon process writes, we read
+#define PROBE_SLOTSIZE	64
+#define MAXPROBES	65536
+
+struct ProbeSlot {
+    volatile uint32_t	seq;		// odd while being updated
+    volatile int	status;		// 1 = up
+    volatile int	latency;	// usec, last check
+    volatile int	fails;		// consecutive
+    volatile int64_t	t_check;	// last check
+    volatile int64_t	checks;
+    volatile uint32_t	gen;		// bumped when the slot is handed out
+    volatile uint32_t	done;		// mon process: gen of the last removed probe
+    char		pad[ PROBE_SLOTSIZE - 40 ];
+};
+
+extern ProbeSlot *mon_slots;
+
 class Monitor {
 protected:
+    int            kind;
     int            freq;
     int            fail_count;
     int            pid;
@@ -24,27 +51,53 @@ protected:
     time_t         t_last;
     time_t         t_next;
     time_t         t_started;
+    hrtime_t       hr_started;
     string         prog;
     string         address;
     int		   kills;
     vector<string> argv;
+    int            fd;		// builtins: socket
+    int            nstate;
+    int            qid;
+    time_t         t_timeout;
+    string         nbuf;
 public:
-    int            uid;
+    int            uid;		// slot. -1 = none
+    string         key;		// freq, address, probe. same probe => same key
 
 protected:
-    void set_status(bool, int);
+    void set_status(bool);
     void start(time_t);
+    void start_native(time_t);
+    void finish(time_t, bool);
+    void cancel(void);
+    void done(time_t, bool);
+    const char *arg(int i, const char *def) const { return (i < (int)argv.size()) ? argv[i].c_str() : def; }
 
 public:
     Monitor(int f, string *ad, string *p, string *a);
-    bool is_running() const { return pid; }
+    bool is_running() const { return pid || fd != -1; }
+    bool is_native()  const { return kind != MON_EXEC; }
+    bool looks_good() const { return uid < 0 || mon_slots[uid].status; }
+    void resume(void);
     bool too_long(time_t)   const;
     void maybe_start(time_t);
-    void wait(int, time_t);
+    void wait(time_t);
     void abort(void);
+    void stop(void);
+    void io(int);
 };
 
+class RR;
+
 extern void mon_restart(void);
+extern void mon_carry_over(const vector<RR*> *, const vector<RR*> *);
+extern void mon_reload(void);
+extern void mon_lock(void);
+extern void mon_unlock(void);
+extern bool mon_probe_info(const Monitor *, ProbeSlot *);
+extern void mon_native_init(void);
+extern int  mon_native_poll(int);
 
 
 #endif // __acdns_mon_h_
@@ -101,6 +101,7 @@ public:
     uint32_t		klass;
     uint32_t		type;
     int			namelen;
+    uint32_t		namehash;	// zhash(name)
     char		name[MAXNAME + 2];
 };
 
@@ -112,6 +113,7 @@ public:
     int			nscount;
     int			arcount;
     bool		has_ns_ans;	// don't do NS auth if we have NS answers
+    bool		trimmed;	// something was left out, no room
 };
 
 class EDNS {
@@ -129,6 +131,8 @@ public:
     uchar		addr[16];
 };
 
+class LogRing;
+
 class NTD {
 public:
     int                 thno;
@@ -143,11 +147,14 @@ public:
     MMD			mmd;
     sockaddr		*sa;
     int			salen;
+    LogRing		*logring;	// this thread's query log queue
+    MMCache		*mmcache;	// this thread's located clients
 
     NTD(int len) : querb(len), respb(len)  {
-        thno = 0; fd = 0;
+        thno = 0; fd = 0; logring = 0; mmcache = 0;
         memset(&stats, 0, sizeof(stats));
     }
+    ~NTD(){ delete mmcache; }
 
     void reset(int max){
         querb.datalen = respb.datalen = 0;
@@ -0,0 +1,48 @@
+/*
+  Copyright (c) 2026
+  Author: agent <agent @ local>
+  Created: 2026-Oct-17 17:52 (EDT)
+  Function: cache of rendered responses
+*/
+
+#ifndef __acdns_rcache_h_
+#define __acdns_rcache_h_
+
+#include <stdint.h>
+
+class NTD;
+
+#define RCACHE_MAXLEN	MAXUDP	// larger responses depend on the client. no caching
+
+// edns, part of the key
+#define RCACHE_F_EDNS	1
+#define RCACHE_F_NSID	2
+
+// direct mapped, one seqlock per slot. readers never block
+// lives in the ZDB, so a new ZDB starts with an empty cache
+class RCache {
+    struct Slot {
+        volatile uint32_t	seq;		// odd = being written
+        uint32_t		hash;
+        uint16_t		type;
+        uint8_t			shape;
+        uint8_t			namelen;
+        uint16_t		datalen;
+        char			name[MAXNAME + 1];
+        uchar			data[RCACHE_MAXLEN];
+    };
+
+    Slot			*slot;
+    uint32_t			mask;
+
+    Slot *find_slot(const NTD *, int) const;
+public:
+    RCache(int);
+    ~RCache();
+    int  get(NTD *, int) const;
+    void put(NTD *, int);
+
+    static int shape(const NTD *);
+};
+
+#endif // __acdns_rcache_h_
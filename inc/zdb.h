@@ -15,6 +15,8 @@
 
 #include "dns.h"
 #include "mon.h"
+#include "datacenter.h"
+#include "arena.h"
 
 using std::string;
 using std::vector;
@@ -26,6 +28,8 @@ class RRSet;
 class Zone;
 class ZDB;
 class InputF;
+class RCache;
+struct ZoneConf;
 
 
 // for map<char*>
@@ -36,25 +40,72 @@ struct CStrComp {
 };
 
 typedef map<const char *, RR*, CStrComp>     MapRR;
-typedef map<const char *, RRSet*, CStrComp>  MapRRSet;
 
+// pre-rendered RRs, in wire format. pointers to the zone
+// (which moves with the question) are filled in at runtime
+class WireImg {
+public:
+    const char		*data;		// in the zone's arena
+    const uint16_t	*zfix;		// offsets of pointers to the zone
+    int			len;
+    int			nzfix;
+    int			count;		// number of RRs
+    bool		has_ns;
+
+    WireImg(){ data = 0; zfix = 0; len = 0; nzfix = 0; count = 0; has_ns = 0; }
+    bool empty() const { return !len; }
+    int put(NTD *) const;
+};
+
+// a WireImg under construction
+class WireBuf {
+public:
+    string		data;
+    vector<uint16_t>	zfix;
+    int			count;
+    bool		has_ns;
+
+    WireBuf(){ count = 0; has_ns = 0; }
+    void put_short(int);
+    void put_long(uint32_t);
+    void put_hdr(int, int, int, int);
+    void put_zptr(void);
+    void add_rr(const RR *, bool);
+    void save(Arena *, WireImg *) const;
+};
 
+// FNV-1a, computed incrementally as the query name is parsed
+#define ZHASH_INIT	2166136261U
+#define ZHASH_ADD(h, c)	(((h) ^ (uchar)(c)) * 16777619U)
+
+inline uint32_t zhash(const char *s, int l){
+    uint32_t h = ZHASH_INIT;
+    for(int i=0; i<l; i++) h = ZHASH_ADD(h, s[i]);
+    return h;
+}
+
+
+// RRs + RRSets live in their zone's arena
 class RR {
 public:
-    string	name;		// for debugging
-    string	name_wire;	// name in wire format, without domain
+    AStr	name;		// for debugging
+    AStr	name_wire;	// name in wire format, without domain
     bool	wildcard;
     bool	delegation;
     int		klass;
     int		type;
     int		ttl;
-    vector<RR*> additional;
+    AVec<RR*>	additional;
 
     Monitor	*probe;
-    bool	probe_ok;
+    WireImg	wire;		// type, class, ttl, rdata - if known at load time
+
+    void *operator new(size_t sz, Arena *a){ return a->alloc(sz); }
+    void operator delete(void *, Arena *) {}
+    void operator delete(void *) {}
 
-    static RR *make(string *, int, int, int, bool);
-    int set_name(string *);
+    static RR *make(Arena *, string *, int, int, int, bool);
+    int set_name(Arena *, string *);
     void add_probe(Monitor *p){ probe = p; }
     virtual int configure(InputF *, Zone *, string *) = 0;
     virtual void analyze(Zone *) {}			// when done loading the zone
@@ -66,7 +117,8 @@ public:
     int put_name(NTD*, bool)           const;
     int put_rr(NTD*, bool)             const;
     virtual int _put_rr(NTD*)          const = 0;
-    bool probe_looks_good()            const { return probe_ok; }
+    bool probe_looks_good()            const { return !probe || probe->looks_good(); }
+    virtual bool is_static()           const { return 1; }	// same answer every time?
     inline bool can_satisfy(int t)     const {
         return t==type || t==TYPE_ANY || type==TYPE_CNAME || type==TYPE_ALIAS;
     }
@@ -82,7 +134,6 @@ protected:
         klass      = 0;
         type       = 0;
         ttl        = 0;
-        probe_ok   = 1;
         probe      = 0;
     }
 };
@@ -92,10 +143,13 @@ protected:
 // insert the data as-is, no compression
 class RR_Raw : public RR {
 protected:
-    string		rrdata;		// includes DNS_RR_Hdr
+    char		*rrdata;	// includes DNS_RR_Hdr
+    int			rrlen;
 
+    RR_Raw(){ rrdata = 0; rrlen = 0; }
     ~RR_Raw() {}
-    void config_raw();
+    DNS_RR_Hdr *config_raw(Zone *, int);
+    void analyze(Zone *) { wire.data = rrdata; wire.len = rrlen; }
 
     int _put_rr(NTD* ntd) const;
 };
@@ -122,13 +176,14 @@ public:
 class RRCompString {
 public:
     bool	same_zone;
-    string	fqdn;
-    string	name;
-    string	domain;
-    string	name_wire;
-    string	dom_wire;
-
-    void set_name(string s, string *);
+    AStr	fqdn;
+    AStr	name;
+    AStr	domain;
+    AStr	name_wire;
+    AStr	dom_wire;
+
+    void set_name(Arena *, string s, string *);
+    void render(WireBuf *)   const;
     int wire_len(NTD*, int)  const;
     int put(NTD*, int)       const;
     int find_ztab(NTD *)     const;
@@ -176,18 +231,20 @@ class RR_SOA   : public RR {
 protected:
     ~RR_SOA() {}
     int _put_rr(NTD* ntd) const;
+    void analyze(Zone*);
 public:
     int configure(InputF *, Zone *, string *);
 };
 
 class RR_Alias : public RR {
-    string		target;
+    AStr		target;
     RRSet		*targ_rrs;
 protected:
     ~RR_Alias() {};
     int add_answer(NTD*, bool, int, int) const;
     void wire_up(ZDB*, Zone*, RRSet *);
     int _put_rr(NTD*) const {}
+    bool is_static() const;
 public:
     RR_Alias(){ targ_rrs = 0; }
     int configure(InputF *, Zone *, string *);
@@ -255,11 +312,13 @@ class RR_GLB_MM  : public RR_GLB {
     string		failover_name;
     int			failover_alg;
     RRSet		*failover_rrset;
+    int			dcid;		// datacenter ids
+    int			failover_dcid;
 
 protected:
     ~RR_GLB_MM() {  }
 public:
-    RR_GLB_MM()  { failover_rrset = 0; }
+    RR_GLB_MM()  { failover_rrset = 0; dcid = DC_NONE; failover_dcid = DC_NONE; }
     int configure(InputF *, Zone *, string *);
     bool datacenter_looks_good() const;
 
@@ -271,21 +330,28 @@ public:
 
 class RRSet {
 public:
-    vector<RR*>			rr;
+    AVec<RR*>			rr;
     bool			wildcard;
     bool			delegation;
-    string			name;		// for searching
-    string			fqdn;		// for searching
+    AStr			name;		// for searching
+    AStr			fqdn;		// for searching
+    uint32_t			hash;		// zhash(fqdn)
     Zone *			zone;
+    AVec< std::pair<int, WireImg> > answer;	// pre-rendered, by qtype
+
+    void *operator new(size_t sz, Arena *a){ return a->alloc(sz); }
+    void operator delete(void *, Arena *) {}
+    void operator delete(void *) {}
 
     virtual ~RRSet();
     virtual void add_rr(RR *);
     virtual int analyze(Zone*);
     void wire_up(ZDB*, Zone *);
-    bool wildmatch(const char *, int)       const;
+    bool needs_wire_up(void) const;
     virtual int add_answers(NTD*, int, int) const;
     virtual int add_additnl(NTD*, int, int) const;
     virtual bool is_compat(RR*)             const;
+    virtual bool is_static()                const;
 
     static RRSet *make(Zone* z, string *l, bool wp, int ty);
 
@@ -301,6 +367,7 @@ protected:
 public:
     RRSet_GLB(Zone* z, string *l, bool wp) : RRSet(z,l,wp) {}
     int add_additnl(NTD*, int, int) const {}
+    bool is_static()                const { return 0; }
 };
 
 class RRSet_GLB_RR : public RRSet_GLB {
@@ -330,9 +397,13 @@ public:
 
 class RRSet_GLB_MM : public RRSet_GLB {
 protected:
-    MapRR		dcrr;
+    vector<const RR_GLB_MM*> bydc;	// by datacenter id
+    vector<float>	dcweight;	// by datacenter id, 1 if not here
+    const RR_GLB_MM	*unknown;
+    const RR_GLB_MM	*lastresort;
+    bool		weighted;	// not all weights are 1
 
-    const RR_GLB_MM *find(const char *)                        const;
+    const RR_GLB_MM *find(int)                                 const;
     void weight_and_sort(NTD *)                                const;
     int add_answers_first_match(NTD *, int)                    const;
     int add_answers_failover(const RR_GLB_MM *, NTD *, int)    const;
@@ -340,10 +411,12 @@ protected:
     int a_a_failover_rrall(const RR_GLB_MM *, NTD *, int)      const;
     int a_a_failover_rrgood(const RR_GLB_MM *, NTD *, int)     const;
     int a_a_failover_specify(const RR_GLB_MM *, NTD *, int)    const;
-    int a_a_failover_specify(const char *, NTD *, int)         const;
+    int a_a_failover_specify(int, NTD *, int)                  const;
 public:
     void add_rr(RR *);
-    RRSet_GLB_MM(Zone* z, string *l, bool wp) : RRSet_GLB(z,l,wp) {}
+    RRSet_GLB_MM(Zone* z, string *l, bool wp) : RRSet_GLB(z,l,wp) {
+        unknown = 0; lastresort = 0; weighted = 0;
+    }
     bool is_compat(RR*)                                        const;
     int add_answers(NTD*, int, int)                            const;
 
@@ -351,29 +424,69 @@ public:
 
 //################################################################
 
+// a zone's rrsets, by label + wildcard. for finding them while loading
+// open addressed, grows as rrsets are added
+class RRSetIndex {
+    struct Ent {
+        uint32_t	hash;
+        RRSet		*rrs;
+    };
+
+    Ent				*tab;
+    uint32_t			mask;
+    uint32_t			count;
+
+    void grow(void);
+public:
+    RRSetIndex(){ tab = 0; mask = 0; count = 0; }
+    ~RRSetIndex(){ delete [] tab; }
+    void add(RRSet *);
+    RRSet *find(const char *, int, bool) const;
+};
+
 class Zone {
     friend class ZDB;
     friend class RRSet;
 public:
     string			zonename;	// fqdn with training .
     string			zonefile;
+    Arena			*arena;		// the zone's RRs, RRSets, names, ...
 private:
+    uint32_t			refs;		// zdbs using this zone
+    time_t			src_mtime;	// zonefile, as loaded
+    int64_t			src_size;
+    int64_t			src_ino;
+
     vector<RRSet*>		rrset;
+    vector<RRSet*>		wired;		// delegations + aliases, wired up per zdb
+    RRSetIndex			byname;
+    vector<RR*>			monitored;	// RRs with probes
 
     // quick access to often needed zone data
     vector<RR*>			ns;		// NS records
     RR*				soa;		// SOA
+    WireImg			ns_auth;	// pre-rendered NS records
 
-    Zone(string *z, string *f){ soa = 0; zonename = *z + "."; zonefile = *f; }
+    Zone(string *z, string *f){
+        soa = 0; zonename = *z + "."; zonefile = *f; arena = new Arena;
+        refs = 0; src_mtime = 0; src_size = 0; src_ino = 0;
+    }
     ~Zone();
-    int load(ZDB*, InputF*);
-    int insert(ZDB *, RR*, string *);
-    int analyze(ZDB*);
-    bool zonematch(const char *, int)      const;
+    void hold(void);
+    bool release(void);
+    bool unchanged(const ZoneConf *) const;
+    void set_src(const struct stat *);
+    int load(InputF*);
+    int add_record(InputF*, string *, bool, int, int, int, string *, string *);
+    int finish_load(InputF*);
+    int insert(RR*, string *);
+    RRSet *new_rrset(string *, bool, int);
+    int analyze(void);
     void wire_up(ZDB*);
 
 public:
     RRSet *find_rrset(string *, bool wild) const;
+    RRSet *find_rrset(const AStr *, bool wild) const;
     int add_ns_auth(NTD*)                  const;
     int add_ns_addl(NTD*)                  const;
     int add_soa_auth(NTD *)                const;
@@ -381,25 +494,75 @@ public:
 
 //################################################################
 
+// open addressed hash table of rrsets, by fqdn
+// built once, after all the zones are loaded
+class RRSetHash {
+    struct Ent {
+        uint32_t	hash;
+        int		len;
+        RRSet		*rrs;
+    };
+
+    vector<RRSet*>		all;
+    Ent				*tab;
+    uint32_t			mask;
+
+public:
+    RRSetHash(){ tab = 0; mask = 0; }
+    ~RRSetHash(){ delete [] tab; }
+    void add(RRSet *r){ all.push_back(r); }
+    void build(void);
+    RRSet *find(const char *, int, uint32_t) const;
+};
+
+// reverse label tree (com -> example -> www) of zones, wildcards + delegations
+// finds the closest enclosing zone + wildcard in one walk
+class LabelTree {
+    class Node {
+    public:
+        string		label;
+        Zone		*zone;		// zone apex
+        RRSet		*wild;		// wildcard or delegation
+        vector<Node*>	kids;		// sorted by label
+
+        Node(){ zone = 0; wild = 0; }
+        ~Node();
+    };
+
+    Node			root;
+
+    Node *child(const Node *, const char *, int) const;
+    Node *node(const string *);
+public:
+    void add_zone(Zone *);
+    void add_wild(RRSet *);
+    void find(const char *, int, Zone **, RRSet **) const;
+};
+
 class ZDB {
     vector<Zone*>		zone;
-    vector<RRSet*>		wildcard;
-    MapRRSet			rrset;
+    RRSetHash			rrset;
+    LabelTree			ltree;
 public:
     vector<RR*>			monitored;
+    RCache			*rcache;	// rendered responses
 
 public:
+    ZDB(){ rcache = 0; }
     ~ZDB();
-    int load(string*, string *);
+    static Zone *load_zone(string*, string *);
+    Zone  *find_zone_conf(const ZoneConf *) const;
+    void add_zone(Zone *);
     RRSet *find_rrset(const char *)       const;
+    RRSet *find_rrset(const char *, int, uint32_t, Zone **) const;
     Zone  *find_zone(const char *)        const;
-    int insert(RRSet *);
+    int insert(RRSet *, bool);
     int analyze();
     void add_monitored(RR*);
 };
 
 extern ZDB *zdb;
-extern int load_zdb(void);
+extern int load_zdb(bool);
 
 
 
@@ -0,0 +1,137 @@
+/*
+  Copyright (c) 2026
+  Author: agent <agent @ local>
+  Created: 2026-Oct-17 19:29 (EDT)
+  Function: bump allocator + interned strings, for the zone data
+*/
+
+#define CURRENT_SUBSYSTEM	'Z'
+
+#include "defs.h"
+#include "misc.h"
+#include "diag.h"
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNKSIZE	(256 * 1024)
+
+
+Arena::Arena(){
+    cur     = end = 0;
+    total   = 0;
+    itab    = 0;
+    imask   = 0;
+    icount  = 0;
+    loading = 1;
+}
+
+Arena::~Arena(){
+
+    for(int i=0; i<(int)chunk.size(); i++)
+        free( chunk[i] );
+
+    delete [] itab;
+}
+
+char *
+Arena::new_chunk(int len){
+
+    if( len > CHUNKSIZE / 4 ){
+        // big. give it its own chunk, keep using the current one
+        char *p = (char*)malloc(len);
+        if( !p ) FATAL("out of memory");
+        chunk.push_back(p);
+        total += len;
+        return p;
+    }
+
+    char *p = (char*)malloc(CHUNKSIZE);
+    if( !p ) FATAL("out of memory");
+    chunk.push_back(p);
+    total += CHUNKSIZE;
+
+    cur = p + len;
+    end = p + CHUNKSIZE;
+    return p;
+}
+
+const char *
+Arena::strdup(const char *s, int len){
+
+    char *p = (char*)alloc(len + 1);
+    memcpy(p, s, len);
+    p[len] = 0;
+    return p;
+}
+
+static inline uint32_t
+ihash(const char *s, int len){
+    uint32_t h = 2166136261U;
+
+    for(int i=0; i<len; i++) h = (h ^ (uchar)s[i]) * 16777619U;
+    return h;
+}
+
+// the same string, once per arena
+const char *
+Arena::intern(const char *s, int len){
+
+    if( !len ) return "";
+    if( !loading ) return strdup(s, len);
+
+    // keep the load factor <= 1/2
+    if( (icount + 1) * 2 > imask + 1 ) igrow();
+
+    uint32_t h = ihash(s, len);
+    uint32_t p = h & imask;
+
+    for( ; itab[p].str; p = (p + 1) & imask){
+        const Ent *e = itab + p;
+        if( e->hash == h && e->len == len && !memcmp(e->str, s, len) )
+            return e->str;
+    }
+
+    itab[p].hash = h;
+    itab[p].len  = len;
+    itab[p].str  = strdup(s, len);
+    icount ++;
+
+    return itab[p].str;
+}
+
+void
+Arena::igrow(void){
+
+    uint32_t n   = itab ? (imask + 1) * 2 : 1024;
+    Ent     *old = itab;
+    uint32_t on  = itab ? imask + 1 : 0;
+
+    itab  = new Ent[ n ];
+    imask = n - 1;
+    memset(itab, 0, n * sizeof(Ent));
+
+    for(uint32_t i=0; i<on; i++){
+        if( !old[i].str ) continue;
+        uint32_t p = old[i].hash & imask;
+        while( itab[p].str ) p = (p + 1) & imask;
+        itab[p] = old[i];
+    }
+
+    delete [] old;
+}
+
+// the intern table is only needed while loading
+// later strings are just copied
+void
+Arena::done_loading(void){
+
+    DEBUG("arena: %lld bytes, %d strings", total, icount);
+
+    delete [] itab;
+    itab    = 0;
+    imask   = 0;
+    icount  = 0;
+    loading = 0;
+}
@@ -0,0 +1,432 @@
+/*
+  Copyright (c) 2026
+  Author: agent <agent @ local>
+  Created: 2026-Oct-17 20:32 (EDT)
+  Function: time the query path, in process
+*/
+
+#include "defs.h"
+#include "misc.h"
+#include "diag.h"
+#include "config.h"
+#include "hrtime.h"
+#include "runmode.h"
+#include "network.h"
+#include "dns.h"
+#include "mmd.h"
+#include "zdb.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+int flag_foreground   = 1;
+int flag_debugall     = 0;
+int force_reload      = 0;
+char *filename_config = 0;
+RunMode runmode;
+
+void mmdb_init(void);
+void zdb_init(void);
+void epoch_init(void);
+
+#define NCLIENT		4096	// -r: random client addrs
+
+static vector<string> name;
+static vector<string> query;
+static vector<int>    qtype;
+
+static struct {
+    const char *name;
+    int  type;
+} type_name[] = {
+    { "A",	TYPE_A     },
+    { "NS",	TYPE_NS    },
+    { "CNAME",	TYPE_CNAME },
+    { "SOA",	TYPE_SOA   },
+    { "PTR",	TYPE_PTR   },
+    { "MX",	TYPE_MX    },
+    { "TXT",	TYPE_TXT   },
+    { "AAAA",	TYPE_AAAA  },
+    { "ANY",	TYPE_ANY   },
+};
+
+
+void
+usage(void){
+    fprintf(stderr, MYNAME "-bench [options] [name ...]\n"
+            "  -c config file. zones + mapping data are loaded as by " MYNAME "d\n"
+            "  -e also send each query with an edns opt record\n"
+            "  -f file of names, one per line\n"
+            "  -L time a full zone load, then this many reloads, each with\n"
+            "     one zone file's mtime bumped (restored after)\n"
+            "  -m time lookups in a mapping datafile, not queries\n"
+            "     (binary search, and the index if the config has it)\n"
+            "  -n number of passes over the queries (default 1000)\n"
+            "     or of lookups (default 10M)\n"
+            "  -r queries from random clients the mapping data can locate\n"
+            "     (default 10.0.0.1)\n"
+            "  -R keep the response + location caches (default: off)\n"
+            "  -t query types, eg. A,AAAA,MX (default A)\n");
+    exit(0);
+}
+
+// rfc 1035 4.1.1, 4.1.2
+static void
+add_query(const char *name, int type, bool edns){
+    string q;
+
+    char hdr[12];
+    memset(hdr, 0, sizeof(hdr));
+    hdr[0] = query.size() >> 8;
+    hdr[1] = query.size();
+    hdr[2] = 1;		// rd
+    hdr[5] = 1;		// qdcount
+    hdr[11] = edns;	// arcount
+    q.assign(hdr, sizeof(hdr));
+
+    const char *p = name;
+    while( *p ){
+        const char *e = strchr(p, '.');
+        int l = e ? e - p : strlen(p);
+        if( !l || l > MAXLABEL ) break;
+        q.push_back( l );
+        q.append(p, l);
+        p += l;
+        if( *p ) p ++;
+    }
+    q.push_back( 0 );
+
+    char qt[4] = { (char)(type >> 8), (char)type, 0, CLASS_IN };
+    q.append(qt, 4);
+
+    if( edns ){
+        // rfc 2671 4.3 - root, OPT, udp size 4096
+        char opt[11] = { 0, 0, TYPE_OPT, 0x10, 0, 0, 0, 0, 0, 0, 0 };
+        q.append(opt, 11);
+    }
+
+    query.push_back(q);
+}
+
+static void
+read_names(const char *file){
+    char buf[512];
+
+    FILE *f = fopen(file, "r");
+    if( !f ){
+        fprintf(stderr, "cannot open %s\n", file);
+        exit(-1);
+    }
+
+    while( fgets(buf, sizeof(buf), f) ){
+        char *p = strtok(buf, " \t\r\n");
+        if( p && *p != '#' ) name.push_back(p);
+    }
+    fclose(f);
+}
+
+static void
+parse_types(char *list){
+
+    for(char *t = strtok(list, ","); t; t = strtok(0, ",")){
+        int i;
+        for(i=0; i<(int)ELEMENTSIN(type_name); i++){
+            if( !strcasecmp(t, type_name[i].name) ) break;
+        }
+        if( i == ELEMENTSIN(type_name) ){
+            fprintf(stderr, "unknown type %s\n", t);
+            exit(-1);
+        }
+        qtype.push_back( type_name[i].type );
+    }
+}
+
+static uint32_t
+rand32(void){
+    return ((uint32_t)random() << 16) ^ random();
+}
+
+// 1.0.0.0 - 223.255.255.255, like mk-datafile-synth
+static uint32_t
+rand_ipv4(void){
+    return (1U << 24) + rand32() % (223U << 24);
+}
+
+// time MMDB_File::locate on random addrs, with the index, then without
+static void
+bench_locate(const char *file, int count){
+    MMDFile_Hdr hdr;
+
+    FILE *f = fopen(file, "r");
+    if( !f || fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != MMDDATAMAGIC ){
+        fprintf(stderr, "cannot read %s\n", file);
+        exit(-1);
+    }
+    fclose(f);
+
+    // ipv4 or 2000::/3, like mk-datafile-synth
+    uchar *addr = (uchar*)malloc(count * 8);
+    memset(addr, 0, count * 8);
+
+    for(int i=0; i<count; i++){
+        uchar *a = addr + i * 8;
+        uint64_t v;
+
+        if( hdr.ipver == 6 )
+            v = 0x2000000000000000ULL | (((uint64_t)rand32() << 32 | rand32()) & 0x1FFFFFFFFFFFFFFFULL);
+        else
+            v = (uint64_t)rand_ipv4() << 32;
+
+        for(int b=0; b<8; b++)
+            a[b] = v >> (56 - 8 * b);
+    }
+
+    DNS_Stats st;
+    NTD *ntd = new NTD(UDPBUFSIZ);
+    ntd->stats = &st;
+
+    int *index = (hdr.ipver == 6) ? &config->ipv6_index : &config->ipv4_index;
+    int  idx   = *index;
+
+    for(int pass = idx ? 0 : 1; pass<2; pass++){
+        *index = !pass;
+
+        hrtime_t t0 = hr_now();
+        MMDB_File *mf = new MMDB_File;
+        if( !mf->load(file) ){
+            fprintf(stderr, "cannot load %s\n", file);
+            exit(-1);
+        }
+        hrtime_t t1 = hr_now();
+
+        int found = 0;
+        for(int i=0; i<count; i++){
+            if( mf->locate(ntd, addr + i * 8) ) found ++;
+        }
+        hrtime_t t2 = hr_now();
+
+        printf("%-8s load %.2f sec, %.2fM lookups/sec, %.1f%% found\n",
+               pass ? "bsearch" : "index",
+               (double)(t1 - t0) / ONE_SECOND_HR,
+               count * 1000.0 / (t2 - t1), found * 100.0 / count);
+        delete mf;
+    }
+
+    *index = idx;
+    free(addr);
+}
+
+// full load, then reloads with one zone changed, as on a config reload
+static void
+bench_reload(int count){
+    vector<ZoneConf*> zc( config->zones.begin(), config->zones.end() );
+    int nz = zc.size();
+
+    if( !nz ){
+        fprintf(stderr, "no zones\n");
+        exit(-1);
+    }
+
+    hrtime_t t0 = hr_now();
+    if( !load_zdb(0) ){
+        fprintf(stderr, "cannot load zones\n");
+        exit(-1);
+    }
+    hrtime_t t1 = hr_now();
+
+    printf("%d zones, full load %.1f ms\n", nz, (double)(t1 - t0) / ONE_MSEC_HR);
+
+    hrtime_t total = 0, best = 0;
+
+    for(int i=0; i<count; i++){
+        const char *file = zc[ i % nz ]->file.c_str();
+        struct stat sb;
+        utimbuf ut;
+
+        if( stat(file, &sb) == -1 ){
+            fprintf(stderr, "cannot stat %s\n", file);
+            exit(-1);
+        }
+        ut.actime  = sb.st_atime;
+        ut.modtime = sb.st_mtime + 1;
+        utime(file, &ut);
+
+        t0 = hr_now();
+        int ok = load_zdb(1);
+        t1 = hr_now();
+
+        ut.modtime = sb.st_mtime;
+        utime(file, &ut);
+
+        if( !ok ){
+            fprintf(stderr, "cannot reload zones\n");
+            exit(-1);
+        }
+
+        total += t1 - t0;
+        if( !best || t1 - t0 < best ) best = t1 - t0;
+    }
+
+    if( count )
+        printf("reload, 1 zone changed: %.1f ms avg, %.1f ms best\n",
+               (double)total / count / ONE_MSEC_HR, (double)best / ONE_MSEC_HR);
+}
+
+int
+main(int argc, char **argv){
+    extern char *optarg;
+    extern int optind;
+    const char *mapfile = 0;
+    int npass   = 0;
+    int caches  = 0;
+    int edns    = 0;
+    int rclient = 0;
+    int reload  = -1;
+    int c;
+
+    while( (c = getopt(argc, argv, "c:ef:hL:m:n:rRt:")) != -1 ){
+        switch(c){
+        case 'c':
+            filename_config = optarg;
+            break;
+        case 'e':
+            edns = 1;
+            break;
+        case 'f':
+            read_names(optarg);
+            break;
+        case 'L':
+            reload = atoi(optarg);
+            break;
+        case 'm':
+            mapfile = optarg;
+            break;
+        case 'n':
+            npass = atoi(optarg);
+            break;
+        case 'r':
+            rclient = 1;
+            break;
+        case 'R':
+            caches = 1;
+            break;
+        case 't':
+            parse_types(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if( !filename_config ){
+        fprintf(stderr, "no config specified!\ntry -c config\n");
+        exit(-1);
+    }
+
+    for(int i=0; i<argc; i++)
+        name.push_back(argv[i]);
+    if( qtype.empty() )
+        qtype.push_back(TYPE_A);
+
+    for(int i=0; i<(int)name.size(); i++){
+        for(int t=0; t<(int)qtype.size(); t++){
+            add_query(name[i].c_str(), qtype[t], 0);
+            if( edns ) add_query(name[i].c_str(), qtype[t], 1);
+        }
+    }
+
+    if( query.empty() && !mapfile && reload < 0 ){
+        fprintf(stderr, "no queries\n");
+        exit(-1);
+    }
+
+    diag_init();
+    if( read_config(filename_config) ){
+        fprintf(stderr, "cannot read config file\n");
+        exit(-1);
+    }
+    if( !caches ){
+        config->response_cache = 0;
+        config->location_cache = 0;
+    }
+
+    if( mapfile ){
+        bench_locate(mapfile, npass ? npass : 10000000);
+        return 0;
+    }
+    if( !npass ) npass = 1000;
+
+    epoch_init();
+    mmdb_init();
+
+    if( reload >= 0 ){
+        bench_reload(reload);
+        return 0;
+    }
+
+    zdb_init();
+
+    DNS_Stats st;
+    NTD *ntd = new NTD(UDPBUFSIZ);
+    ntd->stats = &st;
+
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+
+    // random clients, ones the mapping data can locate if it has them
+    uint32_t client[NCLIENT];
+    for(int i=0; i<NCLIENT; i++){
+        client[i] = 0x0A000001;
+
+        for(int t=0; rclient && t<100; t++){
+            client[i] = rand_ipv4();
+            ntd->reset(MAXUDP);
+            sa.sin_addr.s_addr = htonl( client[i] );
+            ntd->sa    = (sockaddr*)&sa;
+            ntd->salen = sizeof(sa);
+            if( MMDB::locate(ntd) ) break;
+        }
+    }
+
+    int nq = query.size();
+    long long bytes = 0;
+    hrtime_t t0 = hr_now();
+
+    for(int n=0; n<npass; n++){
+        for(int i=0; i<nq; i++){
+            const string *q = &query[i];
+
+            ntd->reset(MAXUDP);
+            sa.sin_addr.s_addr = htonl( client[(n * nq + i) & (NCLIENT - 1)] );
+            ntd->sa    = (sockaddr*)&sa;
+            ntd->salen = sizeof(sa);
+            memcpy(ntd->querb.buf, q->data(), q->length());
+            ntd->querb.datalen = q->length();
+
+            bytes += dns_process(ntd);
+        }
+    }
+
+    hrtime_t t1 = hr_now();
+    long long total = (long long)npass * nq;
+
+    printf("%lld queries, %.1f ns/query, %.1f bytes/answer\n",
+           total, (double)(t1 - t0) / total, (double)bytes / total);
+
+    return 0;
+}
@@ -8,6 +8,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
@@ -29,15 +30,78 @@ fatal(const char *msg){
     exit(-1);
 }
 
+#define MAXZONES	100000
+
+int   port    = 53;
+
+/* random subdomain mode: random label under a random zone */
+int   randomp = 0;
+int   nzone   = 0;
+char *zones[MAXZONES];
+
+void
+read_zones(const char *file){
+    char buf[256];
+
+    FILE *f = fopen(file, "r");
+    if( !f ) fatal("cannot open zone list");
+
+    while( nzone < MAXZONES && fgets(buf, sizeof(buf), f) ){
+        char *p = strtok(buf, " \t\r\n");
+        if( p && *p != '#' ) zones[nzone++] = strdup(p);
+    }
+    fclose(f);
+
+    if( !nzone ) fatal("no zones");
+}
+
+/* name => wire format. returns length */
+int
+put_name(unsigned char *d, const char *name){
+    unsigned char *p = d;
+
+    while( *name ){
+        const char *e = strchr(name, '.');
+        int l = e ? e - name : strlen(name);
+        if( l > 63 ) l = 63;
+        *p++ = l;
+        memcpy(p, name, l);
+        p += l;
+        name += l;
+        if( *name == '.' ) name ++;
+    }
+    *p++ = 0;
+
+    return p - d;
+}
+
+/* build a query for a random label under a random zone */
+int
+random_packet(unsigned char *pkt){
+    char name[300];
+    int l;
+
+    snprintf(name, sizeof(name), "%08lx.%s", random(), nzone ? zones[random() % nzone] : "example.com");
+
+    memcpy(pkt, packet, 12);
+    pkt[0] = random() & 0xFF;
+    pkt[1] = random() & 0xFF;
+    l = 12 + put_name(pkt + 12, name);
+    memcpy(pkt + l, "\x00\x01\x00\x01", 4); /* IN A */
+
+    return l + 4;
+}
+
 void
 blast(const char *addr){
+    unsigned char rpkt[512];
     struct sockaddr_in sa;
 
     if( ! inet_aton(addr, & sa.sin_addr) )
         fatal("invalid dst addr");
 
     sa.sin_family = AF_INET;
-    sa.sin_port   = htons(53);
+    sa.sin_port   = htons(port);
 
     int udp = socket(PF_INET, SOCK_DGRAM, 17);
     if( udp == -1 ){
@@ -45,8 +109,14 @@ blast(const char *addr){
     }
 
     while(1){
+        int i;
+
+        if( randomp ){
+            int l = random_packet(rpkt);
+            i = sendto(udp, rpkt, l, 0, (void*)&sa, sizeof(sa));
+        }else
+            i = sendto(udp, packet, sizeof(packet) - 1, 0, (void*)&sa, sizeof(sa));
 
-        int i = sendto(udp, packet, sizeof(packet) - 1, 0, (void*)&sa, sizeof(sa));
         if( i == -1 ){
             fprintf(stderr, "send failed: %s", strerror(errno));
             sleep(1);
@@ -54,12 +124,35 @@ blast(const char *addr){
     }
 }
 
+/*
+  blast [-r] [-z zonelist] [-p port] [addr]
+    -r  random subdomain queries (nxdomain flood)
+    -z  file of zone names, one per line. implies -r
+*/
 int
 main(int argc, char**argv){
     const char *addr = "127.0.0.1";
+    int c;
+
+    while( (c = getopt(argc, argv, "rz:p:")) != -1 ){
+        switch(c){
+        case 'r':
+            randomp = 1;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'z':
+            randomp = 1;
+            read_zones(optarg);
+            break;
+        default:
+            fatal("usage: blast [-r] [-z zonelist] [-p port] [addr]");
+        }
+    }
 
-    if( argc > 1 )
-        addr = argv[1];
+    if( optind < argc )
+        addr = argv[optind];
 
     blast(addr);
 
@@ -18,6 +18,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
@@ -66,21 +68,36 @@ static int set_debug(Config *, string *);
 static int set_trace(Config *, string *);
 static int add_acl(Config *, string *);
 static int add_zone(Config *, string *);
+static int add_udp_cpus(Config *, string *);
 
 SET_INT_VAL(udp_threads);
 SET_INT_VAL(tcp_threads);
+SET_INT_VAL(load_threads);
+SET_INT_VAL(udp_batch);
+SET_INT_VAL(udp_reuseport);
+SET_INT_VAL(tcp_idle);
+SET_INT_VAL(tcp_maxperclient);
+SET_INT_VAL(response_cache);
 SET_INT_VAL(port_dns);
 SET_INT_VAL(port_console);
 SET_INT_VAL(debuglevel);
 SET_FLOAT_VAL(logpercent);
+SET_INT_VAL(log_ring);
+SET_INT_VAL(ipv4_index);
+SET_INT_VAL(ipv6_index);
+SET_INT_VAL(location_cache);
+SET_INT_VAL(mon_timeout);
 
 SET_STR_VAL(environment);
 SET_STR_VAL(mon_path);
+SET_STR_VAL(listen_ipv4);
+SET_STR_VAL(listen_ipv6);
 SET_STR_VAL(datafile_ipv4);
 SET_STR_VAL(datafile_ipv6);
 SET_STR_VAL(error_mailto);
 SET_STR_VAL(error_mailfrom);
 SET_STR_VAL(logfile);
+SET_STR_VAL(logformat);
 
 static struct {
     const char *word;
@@ -88,14 +105,28 @@ static struct {
 } confmap[] = {
     { "udp_threads",	set_udp_threads    },
     { "tcp_threads",	set_tcp_threads    },
+    { "udp_batch",	set_udp_batch      },
+    { "udp_reuseport",	set_udp_reuseport  },
+    { "udp_cpus",	add_udp_cpus       },
+    { "tcp_idle",	set_tcp_idle       },
+    { "tcp_maxperclient", set_tcp_maxperclient },
+    { "response_cache",	set_response_cache },
     { "port",           set_port_dns     },
+    { "listen_ipv4",	set_listen_ipv4    },
+    { "listen_ipv6",	set_listen_ipv6    },
     { "logfile",	set_logfile        },
+    { "logformat",	set_logformat      },
     { "logpercent",	set_logpercent     },
+    { "log_ring",	set_log_ring       },
     { "console",        set_port_console   },
     { "environment",    set_environment    },
     { "monpath",        set_mon_path       },
+    { "montimeout",     set_mon_timeout    },
     { "ipv4data",	set_datafile_ipv4  },
     { "ipv6data",	set_datafile_ipv6  },
+    { "ipv4index",	set_ipv4_index     },
+    { "ipv6index",	set_ipv6_index     },
+    { "location_cache",	set_location_cache },
     { "debug",          set_debug          },
     { "trace",          set_trace          },
     { "debuglevel",     set_debuglevel     },
@@ -103,6 +134,7 @@ static struct {
     { "error_mailfrom", set_error_mailfrom },
     { "allow",		add_acl     	   },
     { "zone",           add_zone           },
+    { "load_threads",	set_load_threads   },
 
     // ...
 };
@@ -123,6 +155,7 @@ static struct {
     { "zonefile",  'z' },
     { "mon",       'M' },
     { "logfile",   'L' },
+    { "epoch",     'e' },
     // ...
 };
 
@@ -336,6 +369,28 @@ add_zone(Config *cf, string *v){
     return 0;
 }
 
+// cpu [cpu ...]
+// cpu :: number | nodeN
+static int
+add_udp_cpus(Config *cf, string *v){
+
+    if( !v ) return 0;
+
+    int s = 0, e = 0;
+    int l = v->length();
+    while(s < l){
+        e = v->find_first_of(" \t", s);
+        if( e == -1 ) e = l;
+        if( e > s ){
+            cf->udp_cpus.push_back( v->substr(s, e-s) );
+            DEBUG("udp cpu %s", cf->udp_cpus.back().c_str());
+        }
+        s = e + 1;
+    }
+
+    return 0;
+}
+
 //################################################################
 
 static int
@@ -360,11 +415,24 @@ Config::Config(){
 
     udp_threads  = 4;
     tcp_threads  = 4;
+    udp_batch    = 1;
+    udp_reuseport = 0;
+    tcp_idle     = 10;
+    tcp_maxperclient = 16;
+    response_cache = 4096;
+    load_threads = 4;
     port_dns     = 53;
     port_console = 5301;
     debuglevel   = 0;
     logpercent   = 0;
+    log_ring     = 4096;
+    logformat.assign("text");
+    ipv4_index   = 0;
+    ipv6_index   = 1;
+    location_cache = 4096;
+    mon_timeout  = 5;
     environment.assign("unknown");
+    listen_ipv4.assign("0.0.0.0");
 
     memset(debugflags, 0, sizeof(debugflags));
     memset(traceflags, 0, sizeof(traceflags));
@@ -387,11 +455,27 @@ Config::~Config(){
 
 int
 Config::check_acl(const sockaddr* sa) {
-    sockaddr_in *in = (sockaddr_in*)sa;
+    uint32_t addr;
+
+    switch( sa->sa_family ){
+    case AF_INET:
+        addr = ((sockaddr_in*)sa)->sin_addr.s_addr;
+        break;
+    case AF_INET6: {
+        const in6_addr *a6 = & ((sockaddr_in6*)sa)->sin6_addr;
+        if( IN6_IS_ADDR_LOOPBACK(a6) ) return 1;	// always permit localhost
+        // acls are ipv4 only
+        if( ! IN6_IS_ADDR_V4MAPPED(a6) ) return 0;
+        memcpy(&addr, a6->s6_addr + 12, 4);
+        break;
+    }
+    default:
+        return 0;
+    }
 
-    DEBUG("check acl %x", in->sin_addr.s_addr);
+    DEBUG("check acl %x", addr);
 
-    if( in->sin_addr.s_addr == htonl(0x7f000001) )   return 1;	// always permit localhost
+    if( addr == htonl(0x7f000001) )   return 1;	// always permit localhost
 
     ACL_List::iterator final = acls.end(), it;
 
@@ -399,9 +483,9 @@ Config::check_acl(const sockaddr* sa) {
 	ACL *a = *it;
 
 	DEBUG("check %08x == %08x + %08x == %08x",
-	      a->ipv4, in->sin_addr.s_addr, a->mask, (in->sin_addr.s_addr & a->mask));
+	      a->ipv4, addr, a->mask, (addr & a->mask));
 
-	if( a->ipv4 == (in->sin_addr.s_addr & a->mask) ) return 1;
+	if( a->ipv4 == (addr & a->mask) ) return 1;
     }
 
     return 0;
@@ -21,6 +21,7 @@
 #include "runmode.h"
 #include "maint.h"
 #include "zdb.h"
+#include "epoch.h"
 
 #include <string.h>
 #include <ctype.h>
@@ -43,8 +44,9 @@ static int cmd_status(Console *, const char *, int);
 static int cmd_help(Console *, const char *, int);
 static int cmd_reload(Console *, const char *, int);
 static int cmd_maint(Console *, const char *, int);
-static int cmd_probe(Console *, const char *, int);
+static int cmd_probes(Console *, const char *, int);
 static int cmd_stats(Console *, const char *, int);
+static int cmd_threads(Console *, const char *, int);
 
 
 static struct {
@@ -63,8 +65,9 @@ static struct {
     { "rps", 		1, cmd_rps  },	// requests per second
     { "reload",         1, cmd_reload },
     { "maint",		1, cmd_maint },
-    { "probestatus",    0, cmd_probe },	// used by monitor process to update statuses
+    { "probes",		1, cmd_probes },	// status of monitored records
     { "stats",		1, cmd_stats },
+    { "threads",	1, cmd_threads },
     { "help",           1, cmd_help },
     { "?",              0, cmd_help },
 };
@@ -191,27 +194,42 @@ cmd_stats(Console *con, const char *cmd, int len){
 }
 
 static int
-cmd_probe(Console *con, const char *cmd, int len){
-    // probestatus index uid status
-    int idx  = 0;
-    int uid  = 0;
-    int stat = 0;
+cmd_threads(Console *con, const char *cmd, int len){
+    extern void network_thread_report(Console *);
 
-    ZDB *z = zdb;
+    network_thread_report(con);
+    return 1;
+}
 
-    sscanf(cmd, "%d %d %d", &idx, &uid, &stat);
-    if( idx < 0 || idx >= z->monitored.size() ) return 1;
+static int
+cmd_probes(Console *con, const char *cmd, int len){
+    char buf[1024];
+    string out;
+    ProbeSlot ps;
 
-    RR* rr = z->monitored[idx];
-    if( !rr->probe || rr->probe->uid != uid ) return 1;
+    // rows first. output may block, and must not hold up freeing old zdbs
+    epoch_enter(con->epoch);
+    ZDB *z = zdb;
+    time_t now = lr_now();
 
-    DEBUG("probe status %d %d => %d", idx, uid, stat);
+    // name status latency(ms) age(s) checks freq address probe args
+    for(int i=0; i<(int)z->monitored.size(); i++){
+        RR* rr = z->monitored[i];
 
-    if( !stat ){
-        VERBOSE("%s is DOWN", rr->name.c_str());
+        if( !mon_probe_info(rr->probe, &ps) ){
+            snprintf(buf, sizeof(buf), "%s\tNONE\t-\t-\t-\t%s\n", rr->name.c_str(), rr->probe->key.c_str());
+        }else{
+            snprintf(buf, sizeof(buf), "%s\t%s\t%.1f\t%lld\t%lld\t%s\n", rr->name.c_str(),
+                     ps.status ? "UP" : "DOWN", ps.latency / 1000.0,
+                     ps.t_check ? (long long)(now - ps.t_check) : -1LL,
+                     (long long)ps.checks, rr->probe->key.c_str());
+        }
+        out.append(buf);
     }
 
-    rr->probe_ok = stat;
+    epoch_leave(con->epoch);
+
+    con->output(&out);
 
     return 1;
 }
@@ -18,6 +18,7 @@
 #include "network.h"
 #include "lock.h"
 #include "runmode.h"
+#include "epoch.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -173,12 +174,14 @@ Console::Console(int fd) : prompt("? ") {
     _loglevel = 0;
     _onlogq = 0;
     y2_b = 0;
+    epoch = epoch_register();
 }
 
 
 Console::~Console(){
 
     close(_fd);
+    epoch_unregister(epoch);
 
     // remove from diag console queue
     queue_lock.w_lock();
@@ -23,6 +23,8 @@
 #include <sys/wait.h>
 #include <errno.h>
 
+extern void log_reopen(void);
+
 static int i_am_parent = 1;
 static int childpid = 0;
 static char pidfile[64];
@@ -79,6 +81,17 @@ sigrestart(int sig){
     }
 }
 
+static void
+sigreopen(int sig){
+
+    if( i_am_parent && childpid > 1 ){
+        kill(childpid, SIGUSR1);
+    }else{
+        // in child, or foreground
+        log_reopen();
+    }
+}
+
 void
 install_handler(int sig, void(*func)(int)){
     struct sigaction sigi;
@@ -94,6 +107,7 @@ daemon_siginit(void){
 
     // sig handlers
     install_handler(SIGHUP,   sigrestart);
+    install_handler(SIGUSR1,  sigreopen);
     install_handler(SIGINT,   sigexit);
     install_handler(SIGQUIT,  sigexit);
     install_handler(SIGTERM,  sigexit);
@@ -0,0 +1,69 @@
+/*
+  Copyright (c) 2026
+  Author: agent <agent @ local>
+  Created: 2026-Oct-17 18:55 (EDT)
+  Function: datacenter names => small integer ids
+*/
+
+#define CURRENT_SUBSYSTEM	'g'
+
+#include "defs.h"
+#include "misc.h"
+#include "diag.h"
+#include "lock.h"
+#include "datacenter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// append only. readers do not lock
+static const char *dcname[MAXDATACENTER];
+static volatile int ndc = 0;
+static Mutex dclock;
+
+
+int
+dc_id(const char *dc){
+
+    if( ! strcmp(dc, ":unknown") )    return DC_UNKNOWN;
+    if( ! strcmp(dc, ":lastresort") ) return DC_LASTRESORT;
+
+    int n = ndc;
+    for(int i=0; i<n; i++){
+        if( !strcmp(dc, dcname[i]) ) return i;
+    }
+
+    return DC_NONE;
+}
+
+// datacenters are registered when mmdb is loaded
+int
+dc_register(const char *dc){
+
+    dclock.lock();
+
+    int id = dc_id(dc);
+
+    if( id == DC_NONE ){
+        if( ndc >= MAXDATACENTER ){
+            PROBLEM("too many datacenters. cannot add %s", dc);
+        }else{
+            dcname[ndc] = strdup(dc);
+            MEMBAR();
+            id = ndc ++;
+            DEBUG("datacenter %s => %d", dc, id);
+        }
+    }
+
+    dclock.unlock();
+    return id;
+}
+
+const char *
+dc_name(int id){
+
+    if( id == DC_UNKNOWN )    return ":unknown";
+    if( id == DC_LASTRESORT ) return ":lastresort";
+    if( id < 0 || id >= ndc ) return 0;
+    return dcname[id];
+}
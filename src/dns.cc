@@ -18,6 +18,7 @@
 #include "runmode.h"
 #include "dns.h"
 #include "zdb.h"
+#include "rcache.h"
 #include "version.h"
 
 #include <sys/socket.h>
@@ -157,6 +158,7 @@ parse_question(NTD *ntd){
     uchar *qe = (uchar*) ntd->querb.buf + dlen - 1;
     uchar *qp = qs;
     int dpos  = 0;
+    uint32_t h = ZHASH_INIT;
 
     // process qname
     while(qp <= qe && dpos <= MAXNAME){
@@ -168,16 +170,22 @@ parse_question(NTD *ntd){
         if( dpos + lablen + 1 > MAXNAME )     return 0;
 
         for(int i=0; i<lablen; i++){
-            ntd->querd.name[dpos++] = tolower(*qp++);
+            int c = tolower(*qp++);
+            ntd->querd.name[dpos++] = c;
+            h = ZHASH_ADD(h, c);
         }
 
         ntd->querd.name[dpos++] = '.';
+        h = ZHASH_ADD(h, '.');
     }
 
-    if( !dpos )
+    if( !dpos ){
         ntd->querd.name[dpos++] = '.';
+        h = ZHASH_ADD(h, '.');
+    }
 
     ntd->querd.name[dpos] = 0;
+    ntd->querd.namehash   = h;
 
     // process type/class
     if( qe - qp + 1 < 4 ) return 0;
@@ -308,7 +316,10 @@ add_edns(NTD *ntd){
         rdlen += 2 + 4;
     }
 
-    if( !ntd->space_avail(rdlen + 11) ) return 0;
+    if( !ntd->space_avail(rdlen + 11) ){
+        ntd->respd.trimmed = 1;
+        return 0;
+    }
 
     ntd->respb.put_byte(0);	// null name
     ntd->respb.put_rr( TYPE_OPT, MAXUDPEXT, 0, rdlen );
@@ -479,10 +490,24 @@ dns_process(NTD *ntd){
 
     if( qury->arcount )        parse_edns(ntd);
 
+    // seen this before?
+    ZDB *db    = zdb;
+    int rshape = db->rcache ? RCache::shape(ntd) : -1;
+
+    if( rshape >= 0 ){
+        if( db->rcache->get(ntd, rshape) ){
+            INCSTAT(ntd, n_rcache_hit);
+            INCSTAT(ntd, n_rcode[0]);
+            maybe_log(ntd);
+            return ntd->respb.datalen;
+        }
+        INCSTAT(ntd, n_rcache_miss);
+    }
+
     // find answer
 
-    RRSet *rrs = zdb->find_rrset( ntd->querd.name );
-    Zone  *z   = rrs ? rrs->zone : zdb->find_zone( ntd->querd.name );
+    Zone  *z;
+    RRSet *rrs = db->find_rrset( ntd->querd.name, ntd->querd.namelen, ntd->querd.namehash, &z );
 
     DEBUG("found rrs %x z %x (%s)", rrs, z, z? z->zonename.c_str() : "-");
 
@@ -528,6 +553,10 @@ dns_process(NTD *ntd){
     DEBUG("replying %d", ntd->respb.datalen);
     ntd->fill_header();
 
+    // only exact matches. random names under a wildcard or delegation would just churn the cache
+    if( rshape >= 0 && rrs && !rrs->wildcard && !rrs->delegation && rrs->is_static() )
+        db->rcache->put(ntd, rshape);
+
     // log some requests
     maybe_log(ntd);
 
@@ -0,0 +1,175 @@
+/*
+  Copyright (c) 2026
+  Author: agent <agent @ local>
+  Created: 2026-Oct-17 18:59 (EDT)
+  Function: epoch based reclamation of swapped out data (zdb, mmdb)
+*/
+
+#define CURRENT_SUBSYSTEM	'e'
+
+#include "defs.h"
+#include "misc.h"
+#include "diag.h"
+#include "lock.h"
+#include "hrtime.h"
+#include "thread.h"
+#include "network.h"
+#include "epoch.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <list>
+using std::list;
+
+// readers put the current epoch in their slot while running a request.
+// retired data gets a new epoch, and is deleted once no slot
+// holds an older one. so a slow reader delays the delete,
+// instead of crashing.
+
+#define EPOCH_POLL	10000		// usec, reaper sleep
+#define EPOCH_WARN	30		// sec, complain about a stuck reader
+
+class Epoch_Retired {
+public:
+    void		(*fn)(void *);
+    void		*obj;
+    uint64_t		epoch;
+    hrtime_t		when;
+};
+
+volatile uint64_t epoch_global = 1;
+
+static Epoch_Slot slot[MAXEPOCHSLOT];
+static volatile int nslot = 0;
+static Mutex slotlock;
+
+static list<Epoch_Retired> retired;
+static Mutex retirelock;
+
+static volatile int64_t stat_pending   = 0;
+static volatile int64_t stat_grace     = 0;
+static volatile int64_t stat_grace_max = 0;
+
+
+Epoch_Slot *
+epoch_register(void){
+    Epoch_Slot *s = 0;
+
+    slotlock.lock();
+    for(int i=0; i<MAXEPOCHSLOT; i++){
+        if( slot[i].inuse ) continue;
+        s = slot + i;
+        s->epoch = 0;
+        s->inuse = 1;
+        if( i >= nslot ) nslot = i + 1;
+        break;
+    }
+    slotlock.unlock();
+
+    if( !s ) FATAL("out of epoch slots");
+    return s;
+}
+
+void
+epoch_unregister(Epoch_Slot *s){
+
+    slotlock.lock();
+    s->epoch = 0;
+    s->inuse = 0;
+    slotlock.unlock();
+}
+
+void
+epoch_retire_fn(void (*fn)(void *), void *obj){
+    Epoch_Retired r;
+
+    // make the new pointer visible before advancing the epoch
+    MEMBAR();
+
+    r.fn    = fn;
+    r.obj   = obj;
+    r.epoch = ATOMIC_ADD64(epoch_global, 1) + 1;
+    r.when  = hr_now();
+
+    retirelock.lock();
+    retired.push_back(r);
+    stat_pending = retired.size();
+    retirelock.unlock();
+
+    DEBUG("retired %p, epoch %lld", obj, r.epoch);
+}
+
+// oldest epoch any reader is still in
+static uint64_t
+oldest_active(void){
+    uint64_t min = 0;
+
+    MEMBAR();
+    int n = nslot;
+    for(int i=0; i<n; i++){
+        uint64_t e = slot[i].epoch;
+        if( !e ) continue;
+        if( !min || e < min ) min = e;
+    }
+
+    return min;
+}
+
+static void *
+epoch_reap(void *){
+    time_t warned = 0;
+
+    while(1){
+        usleep( EPOCH_POLL );
+        if( !stat_pending ) continue;
+
+        uint64_t active = oldest_active();
+        hrtime_t now    = hr_now();
+        list<Epoch_Retired> done;
+
+        retirelock.lock();
+        while( !retired.empty() ){
+            Epoch_Retired *r = & retired.front();
+            if( active && active < r->epoch ) break;
+            done.push_back(*r);
+            retired.pop_front();
+        }
+        stat_pending = retired.size();
+        bool stuck = !retired.empty() && (now - retired.front().when) / 1000000000LL > EPOCH_WARN;
+        retirelock.unlock();
+
+        if( stuck && lr_now() > warned + EPOCH_WARN ){
+            PROBLEM("reader stuck in epoch %lld. cannot free old data", active);
+            warned = lr_now();
+        }
+
+        while( !done.empty() ){
+            Epoch_Retired *r = & done.front();
+            int64_t wait = (now - r->when) / 1000;	// usec
+
+            stat_grace = wait;
+            if( wait > stat_grace_max ) stat_grace_max = wait;
+            DEBUG("freeing %p, epoch %lld, waited %lld usec", r->obj, r->epoch, wait);
+
+            r->fn( r->obj );
+            done.pop_front();
+        }
+    }
+
+    return 0;
+}
+
+void
+epoch_init(void){
+    start_thread( epoch_reap, 0 );
+}
+
+// not per thread, fill them in after the per thread stats are summed
+void
+epoch_stats(DNS_Stats *st){
+
+    ATOMIC_SETPTR(st->n_epoch_pending,   stat_pending);
+    ATOMIC_SETPTR(st->n_epoch_grace,     stat_grace);
+    ATOMIC_SETPTR(st->n_epoch_grace_max, stat_grace_max);
+}
@@ -23,21 +23,32 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#include <algorithm>
-
 
 void
 RRSet_GLB_MM::add_rr(RR *r){
 
     RRSet::add_rr(r);
 
+    // index by datacenter id, so the query path does not need strings
     RR_GLB_MM *rm = (RR_GLB_MM*)r;
-    dcrr[ rm->datacenter.c_str() ] = r;
+    int id = rm->dcid;
+
+    if( id == DC_UNKNOWN )    unknown    = rm;
+    if( id == DC_LASTRESORT ) lastresort = rm;
+    if( id < 0 ) return;
+
+    if( id >= (int)bydc.size() ){
+        bydc.resize( id + 1 );
+        dcweight.resize( id + 1, 1.0 );
+    }
+    bydc[id]     = rm;
+    dcweight[id] = rm->weight;
+    if( rm->weight != 1.0 ) weighted = 1;
 }
 
 // respond with all available matching RRs
 static inline int
-respond(NTD *ntd, const RRSet *rs, int qty){
+respond(NTD *ntd, const RRSet *rs, int qty, const char *dc){
     int ok = 0;
 
     for(int i=0; i<rs->rr.size(); i++){
@@ -51,12 +62,14 @@ respond(NTD *ntd, const RRSet *rs, int qty){
         ok = 1;
     }
 
+    // for the log
+    if( ok ) ntd->mmd.datacenter = dc;
     return ok;
 }
 
 bool
 RR_GLB_MM::datacenter_looks_good(void) const{
-    return ! maint_get( datacenter.c_str() );
+    return ! maint_get( dcid );
 }
 
 int
@@ -103,7 +116,7 @@ RRSet_GLB_RR::add_answers(NTD *ntd, int qkl, int qty) const {
     }
 
     if( best ){
-        return respond(ntd, best, qty);
+        return respond(ntd, best, qty, 0);
     }
 
     INCSTAT(ntd, n_glb_failover_fail);
@@ -111,12 +124,12 @@ RRSet_GLB_RR::add_answers(NTD *ntd, int qkl, int qty) const {
 }
 
 // find entry for specified datacenter
-const RR_GLB_MM*
-RRSet_GLB_MM::find(const char *dc) const {
-    MapRR::const_iterator it = dcrr.find(dc);
-    if( it == dcrr.end() ) return 0;		// QQQ - should this be logged?
-    const RR_GLB_MM *r = (RR_GLB_MM*) it->second;
-    return r;
+inline const RR_GLB_MM*
+RRSet_GLB_MM::find(int id) const {
+    if( id == DC_UNKNOWN )    return unknown;
+    if( id == DC_LASTRESORT ) return lastresort;
+    if( id < 0 || id >= (int)bydc.size() ) return 0;
+    return bydc[ id ];
 }
 
 void
@@ -124,14 +137,25 @@ RRSet_GLB_MM::weight_and_sort(NTD *ntd) const {
     MMElem *mme = ntd->mmd.mm;
     int nelem   = ntd->mmd.nelem;
 
+    // datafile already ranked them. nothing to do unless weighted
+    if( ntd->mmd.ranked && !weighted ) return;
+
+    int nw = dcweight.size();
+
     for(int i=0; i<nelem; i++){
-        if( ! mme[i].datacenter ) continue;
-        const RR_GLB_MM *r = find( mme[i].datacenter );
-        if( !r ) continue;
+        int id = mme[i].dcid;
+        if( id < 0 || id >= nw ) continue;
         // higher weight = more preferred. => lower metric
-        mme[i].metric = int( mme[i].metric / r->weight );
+        mme[i].metric = int( mme[i].metric / dcweight[id] );
+    }
+
+    // only a few, and with ranked data mostly in order already
+    for(int i=1; i<nelem; i++){
+        MMElem e = mme[i];
+        int j = i;
+        for( ; j>0 && e < mme[j-1]; j-- ) mme[j] = mme[j-1];
+        mme[j] = e;
     }
-    std::sort( mme, mme + nelem );
 }
 
 int
@@ -157,7 +181,7 @@ RRSet_GLB_MM::add_answers(NTD *ntd, int qkl, int qty) const {
         ntd->mmd.logflags |= GLBMM_F_NOLOC;
         // don't know where this user is
         // is there a configured "unknown" record?
-        int res = a_a_failover_specify(":unknown", ntd, qty);
+        int res = a_a_failover_specify(DC_UNKNOWN, ntd, qty);
         if( res ) return res;
         // otherwise use the first available
         return add_answers_first_match(ntd, qty);
@@ -171,12 +195,12 @@ RRSet_GLB_MM::add_answers(NTD *ntd, int qkl, int qty) const {
 
     // try to find best match
     for(int i=0; i<nelem; i++){
-        const char *dcn = mme[i].datacenter;
-        if( !dcn ) continue;
-        const RR_GLB_MM *r = find(dcn);
+        int dcid = mme[i].dcid;
+        if( dcid < 0 ) continue;
+        const RR_GLB_MM *r = find(dcid);
         const RRSet *rs = r ? r->comp_rrset : 0;
         if( ! rs ){
-            mme[i].datacenter = 0;
+            mme[i].dcid = DC_NONE;
             continue;
         }
         bool dcok = r->datacenter_looks_good();
@@ -193,8 +217,8 @@ RRSet_GLB_MM::add_answers(NTD *ntd, int qkl, int qty) const {
 
             if( !best && ok ){
                 // best RR is up - use it. done
-                DEBUG("best dc is %s, is up, using %s", dcn, rr->name.c_str());
-                respond(ntd, rs, qty );
+                DEBUG("best dc is %s, is up, using %s", dc_name(dcid), rr->name.c_str());
+                respond(ntd, rs, qty, dc_name(dcid) );
                 return 1;
             }
 
@@ -208,7 +232,7 @@ RRSet_GLB_MM::add_answers(NTD *ntd, int qkl, int qty) const {
 
         if( !match ){
             // not usable, cross it off
-            mme[i].datacenter = 0;
+            mme[i].dcid = DC_NONE;
             navail --;
         }
     }
@@ -222,7 +246,7 @@ RRSet_GLB_MM::add_answers(NTD *ntd, int qkl, int qty) const {
         res = add_answers_failover(best, ntd, qty);
 
     if( !res )
-        res = a_a_failover_specify(":lastresort", ntd, qty);
+        res = a_a_failover_specify(DC_LASTRESORT, ntd, qty);
 
     if( res ) return res;
 
@@ -254,7 +278,7 @@ RRSet_GLB_MM::add_answers_first_match(NTD *ntd, int qty) const {
             if( ! rr->probe_looks_good() ) continue;
 
             DEBUG("cannot locate user, using %s", rr->name.c_str());
-            respond(ntd, rs, qty );
+            respond(ntd, rs, qty, r->datacenter.c_str() );
             return 1;
         }
     }
@@ -272,7 +296,7 @@ RRSet_GLB_MM::add_answers_failover(const RR_GLB_MM *dbest, NTD *ntd, int qty) co
     int res;
 
     if( dbest->failover_rrset )
-        return respond(ntd, dbest->failover_rrset, qty);
+        return respond(ntd, dbest->failover_rrset, qty, dbest->failover_name.c_str());
 
     switch( dbest->failover_alg ){
     case GLB_FAILOVER_NEXTBEST:
@@ -303,16 +327,16 @@ RRSet_GLB_MM::a_a_failover_nextbest(const RR_GLB_MM *dbest, NTD *ntd, int qty) c
     int nelem   = ntd->mmd.nelem;
 
     for(int i=0; i<nelem; i++){
-        const char *dcn = mme[i].datacenter;
-        if( !dcn ) continue;
-        const RR_GLB_MM *r = find(dcn);
+        int dcid = mme[i].dcid;
+        if( dcid < 0 ) continue;
+        const RR_GLB_MM *r = find(dcid);
         if( ! r ) continue;
         const RRSet *rs = r->comp_rrset;
         if( ! rs ) continue;
 
         // NB: list has already been pruned, this matches and is available
-        DEBUG("failover nextbest dc is %s, using %s", dcn, rs->name.c_str());
-        return respond(ntd, rs, qty);
+        DEBUG("failover nextbest dc is %s, using %s", dc_name(dcid), rs->name.c_str());
+        return respond(ntd, rs, qty, dc_name(dcid));
     }
 
     return 0;
@@ -325,25 +349,27 @@ RRSet_GLB_MM::a_a_failover_rrall(const RR_GLB_MM * dbest, NTD *ntd, int qty) con
     MMElem *mme = ntd->mmd.mm;
     int nelem   = ntd->mmd.nelem;
     const RRSet *best = 0;
+    int bestdc = DC_NONE;
     int nm = 0;
 
     for(int i=0; i<nelem; i++){
-        const char *dcn = mme[i].datacenter;
-        if( !dcn ) continue;
-        const RR_GLB_MM *r = find(dcn);
+        int dcid = mme[i].dcid;
+        if( dcid < 0 ) continue;
+        const RR_GLB_MM *r = find(dcid);
         if( ! r )  continue;
         const RRSet *rs = r->comp_rrset;
         if( ! rs ) continue;
 
         nm ++;
         if( with_probability(1.0 / nm) ){
-            best = rs;
+            best   = rs;
+            bestdc = dcid;
         }
     }
 
     if( best ){
         DEBUG("failover rrall using %s", best->name.c_str());
-        return respond(ntd, best, qty);
+        return respond(ntd, best, qty, dc_name(bestdc));
     }
 
     return 0;
@@ -359,6 +385,7 @@ RRSet_GLB_MM::a_a_failover_rrgood(const RR_GLB_MM *dbest, NTD *ntd, int qty) con
     MMElem *mme = ntd->mmd.mm;
     int nelem   = ntd->mmd.nelem;
     const RRSet *best = 0;
+    int bestdc = DC_NONE;
     int nm = 0;
 
     if( nelem < 2 ) return 0;
@@ -366,26 +393,27 @@ RRSet_GLB_MM::a_a_failover_rrgood(const RR_GLB_MM *dbest, NTD *ntd, int qty) con
         mme[0].metric + (mme[nelem-1].metric - mme[0].metric) * (nelem - 1) / (nelem - 2) / 2;
 
     for(int i=0; i<nelem; i++){
-        const char *dcn = mme[i].datacenter;
-        if( !dcn ) continue;
+        int dcid = mme[i].dcid;
+        if( dcid < 0 ) continue;
 
         // make sure we use at least 2
         if( nm > 2 && mme[i].metric > thold ) continue;
 
-        const RR_GLB_MM *r = find(dcn);
+        const RR_GLB_MM *r = find(dcid);
         if( ! r )  continue;
         const RRSet *rs = r->comp_rrset;
         if( ! rs ) continue;
 
         nm ++;
         if( with_probability(1.0 / nm) ){
-            best = rs;
+            best   = rs;
+            bestdc = dcid;
         }
     }
 
     if( best ){
         DEBUG("failover rrgood using %s", best->name.c_str());
-        return respond(ntd, best, qty);
+        return respond(ntd, best, qty, dc_name(bestdc));
     }
 
     return 0;
@@ -395,12 +423,11 @@ int
 RRSet_GLB_MM::a_a_failover_specify(const RR_GLB_MM *dbest, NTD *ntd, int qty) const {
 
     // use configured datacenter
-    const char *where  = dbest->failover_name.c_str();
-    return a_a_failover_specify(where, ntd, qty);
+    return a_a_failover_specify(dbest->failover_dcid, ntd, qty);
 }
 
 int
-RRSet_GLB_MM::a_a_failover_specify(const char *dst, NTD *ntd, int qty) const {
+RRSet_GLB_MM::a_a_failover_specify(int dst, NTD *ntd, int qty) const {
 
     // use specified dst
     const RR_GLB_MM *r = find( dst );
@@ -415,8 +442,8 @@ RRSet_GLB_MM::a_a_failover_specify(const char *dst, NTD *ntd, int qty) const {
         if( ! rr->probe_looks_good() ) continue;
         if( ! rr->can_satisfy(qty) )   continue;
 
-        DEBUG("failover to specified '%s', using %s", dst, rr->name.c_str());
-        return respond(ntd, rs, qty);
+        DEBUG("failover to specified '%s', using %s", dc_name(dst), rr->name.c_str());
+        return respond(ntd, rs, qty, dc_name(dst));
     }
 
     return 0;
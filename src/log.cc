@@ -18,6 +18,7 @@
 #include "dns.h"
 #include "zdb.h"
 #include "version.h"
+#include "thread.h"
 
 #include <sys/socket.h>
 #include <stdlib.h>
@@ -25,8 +26,172 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/stat.h>
+#include <errno.h>
 
-static Mutex loglock;
+#include <map>
+using std::map;
+
+#define LOGINTERVAL	10000		// usec, writer idle sleep
+#define MAXRETRY	60		// seconds, between attempts to open the log
+#define COMPLAINT	60		// seconds, between complaints
+#define MAXLOGDC	32
+
+// binary format: fixed header, then qname + datacenter. all big-endian
+// see also tools/dnslog
+#define LOGBIN_VERSION	1
+#define LOGBIN_HDRLEN	60
+#define LOGBIN_F_TCP	1
+
+// one logged query
+struct LogRec {
+    time_t		when;
+    uint16_t		family;
+    uint16_t		klass;
+    uint16_t		type;
+    uint16_t		flags;
+    uint16_t		size;
+    uint16_t		udpsize;
+    bool		tcp;
+    uchar		addr[16];
+    uchar		edns_family;
+    uchar		edns_src;
+    uchar		edns_scope;
+    uchar		edns_addr[16];
+    uint32_t		mmflags;
+    char		datacenter[MAXLOGDC];
+    char		name[MAXNAME + 1];
+};
+
+// single producer (the network thread), single consumer (the writer)
+class LogRing {
+public:
+    LogRing		*next;
+    LogRec		*rec;
+    uint32_t		mask;
+    volatile uint32_t	head;		// written by producer
+    volatile uint32_t	tail;		// written by consumer
+
+    LogRing(int);
+};
+
+static LogRing *ring_list = 0;
+static map<int, LogRing*> ring_thread;	// by thno
+static Mutex ring_lock;
+static volatile int reopen_log = 0;
+
+static void *log_writer(void*);
+
+LogRing::LogRing(int n){
+    int sz = 1;
+
+    while( sz < n ) sz <<= 1;
+    rec  = new LogRec[ sz ];
+    mask = sz - 1;
+    head = tail = 0;
+    next = 0;
+}
+
+void
+log_init(void){
+    start_thread( log_writer, 0 );
+}
+
+// from signal handler
+void
+log_reopen(void){
+    reopen_log = 1;
+}
+
+// one ring per network thread, shared by all of its NTDs
+static LogRing *
+log_ring_get(int thno){
+
+    ring_lock.lock();
+    LogRing *r = ring_thread[thno];
+
+    if( !r ){
+        r = new LogRing( config->log_ring > 0 ? config->log_ring : 1024 );
+        r->next   = ring_list;
+        ring_list = r;
+        ring_thread[thno] = r;
+        DEBUG("log ring for thread %d", thno);
+    }
+    ring_lock.unlock();
+
+    return r;
+}
+
+// srcaddr question rf size edns-client
+
+void
+log_request(NTD *ntd){
+
+    if( config->logfile.empty() ) return;
+
+    if( !ntd->logring ) ntd->logring = log_ring_get(ntd->thno);
+    LogRing *r = ntd->logring;
+    uint32_t h = r->head;
+
+    if( h - r->tail > r->mask ){
+        // full. writer is behind
+        INCSTAT(ntd, n_log_drop);
+        return;
+    }
+
+    LogRec *l = r->rec + (h & r->mask);
+
+    l->when    = lr_now();
+    l->family  = ntd->sa->sa_family;
+    l->tcp     = (ntd->querb.bufsize != UDPBUFSIZ);
+    l->klass   = ntd->querd.klass;
+    l->type    = ntd->querd.type;
+    l->flags   = ntd->respd.flags & ~FLAG_RESPONSE;
+    l->size    = ntd->respb.datalen;
+    l->udpsize = ntd->edns.udpsize;
+    l->mmflags = ntd->mmd.logflags;
+
+    // NB: copy, the zdb may be gone by the time this is written
+    const char *dc = ntd->mmd.datacenter;
+    int dl = dc ? strlen(dc) : 0;
+    if( dl >= MAXLOGDC ) dl = MAXLOGDC - 1;
+    if( dl ) memcpy(l->datacenter, dc, dl);
+    l->datacenter[dl] = 0;
+
+    // NB: slots are reused. the binary log writes all 16 bytes
+    memset(l->addr, 0, 16);
+    switch( l->family ){
+    case AF_INET:
+        memcpy(l->addr, & ((sockaddr_in*)ntd->sa)->sin_addr, 4);
+        break;
+    case AF_INET6:
+        memcpy(l->addr, & ((sockaddr_in6*)ntd->sa)->sin6_addr, 16);
+        break;
+    }
+
+    l->edns_family = ntd->edns.addr_family;
+    if( l->edns_family ){
+        l->edns_src   = ntd->edns.src_masklen;
+        l->edns_scope = ntd->edns.scope_masklen;
+        memcpy(l->edns_addr, ntd->edns.addr, 16);
+    }else{
+        l->edns_src   = 0;
+        l->edns_scope = 0;
+        memset(l->edns_addr, 0, 16);
+    }
+
+    int nl = strlen(ntd->querd.name);
+    if( nl > MAXNAME ) nl = MAXNAME;
+    memcpy(l->name, ntd->querd.name, nl);
+    l->name[nl] = 0;
+
+    // record must be complete before the writer can see it
+    MEMBAR();
+    r->head = h + 1;
+    INCSTAT(ntd, n_log);
+}
+
+//################################################################
 
 static void
 out_ipv4(FILE *f, uchar *addr){
@@ -46,78 +211,179 @@ out_ipv6(FILE *f, uint16_t *addr){
                 htons(addr[4]), htons(addr[5]), htons(addr[6]), htons(addr[7]));
 }
 
-
-// srcaddr question rf size edns-client
-
-void
-log_request(NTD *ntd){
-    FILE *f;
-    sockaddr_in *si;
-    sockaddr_in6 *ss;
-    uchar *addr;
-    time_t now = lr_now();
+static void
+log_output(FILE *f, LogRec *l){
     char buf[24];
+    struct tm tm;
 
-    if( config->logfile.empty() ) return;
-
-    // try to get lock, skip logging if someone else has it
-    if( loglock.trylock() ) return;
-
-    f = fopen(config->logfile.c_str(), "a");
-    if( !f ){
-        PROBLEM("cannot open %s", config->logfile.c_str());
-        loglock.unlock();
-        return;
-    }
-
-    // NB: gmtime is thread safe on solaris
-    strftime(buf, sizeof(buf), "%Y%m%dT%H%M%SZ ", gmtime(&now));
+    strftime(buf, sizeof(buf), "%Y%m%dT%H%M%SZ ", gmtime_r(&l->when, &tm));
     fputs(buf, f);
 
-    switch( ntd->sa->sa_family ){
+    switch( l->family ){
     case AF_INET:
-        si = (sockaddr_in*)ntd->sa;
-        out_ipv4(f, (uchar*)& si->sin_addr);
+        out_ipv4(f, l->addr);
         break;
     case AF_INET6:
-        ss = (sockaddr_in6*)ntd->sa;
-        out_ipv6(f, (uint16_t*)& ss->sin6_addr);
+        out_ipv6(f, (uint16_t*)l->addr);
         break;
     }
 
-
     fprintf(f, " %s %s/%d-%d %x %d",
-            (ntd->querb.bufsize == UDPBUFSIZ) ? "udp" : "tcp",
-            ntd->querd.name, ntd->querd.klass, ntd->querd.type,
-            ntd->respd.flags & ~FLAG_RESPONSE, ntd->respb.datalen);
+            l->tcp ? "tcp" : "udp",
+            l->name, l->klass, l->type, l->flags, l->size);
 
-    if( ntd->edns.udpsize ){
-        fprintf(f, " edns %d ", ntd->edns.udpsize);
+    if( l->udpsize ){
+        fprintf(f, " edns %d ", l->udpsize);
     }
 
-    switch( ntd->edns.addr_family ){
+    switch( l->edns_family ){
     case EDNS0_FAMILY_IPV4:
-        out_ipv4(f, ntd->edns.addr);
-        fprintf(f, "/%d/%d", ntd->edns.src_masklen, ntd->edns.scope_masklen);
+        out_ipv4(f, l->edns_addr);
+        fprintf(f, "/%d/%d", l->edns_src, l->edns_scope);
         break;
     case EDNS0_FAMILY_IPV6:
-        out_ipv6(f, (uint16_t*)ntd->edns.addr);
-        fprintf(f, "/%d/%d", ntd->edns.src_masklen, ntd->edns.scope_masklen);
+        out_ipv6(f, (uint16_t*)l->edns_addr);
+        fprintf(f, "/%d/%d", l->edns_src, l->edns_scope);
         break;
     }
 
-
     // anything else?
-    int mmflag = ntd->mmd.logflags;
+    int mmflag = l->mmflags;
     if( mmflag & GLBMM_F_NOLOC )    fprintf(f, " noloc");
     if( mmflag & GLBMM_F_FAIL  )    fprintf(f, " glbf/o");
     if( mmflag & GLBMM_F_FAILFAIL ) fprintf(f, " glbf/o/f");
 
     fprintf(f, "\n");
-    fclose(f);
+}
 
-    // release the lock
-    loglock.unlock();
+static inline uchar *
+put_short(uchar *p, int v){
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
 }
 
+static inline uchar *
+put_long(uchar *p, uint32_t v){
+    p = put_short(p, v >> 16);
+    return put_short(p, v);
+}
+
+// length prefixed record
+static void
+log_output_bin(FILE *f, LogRec *l){
+    uchar buf[ LOGBIN_HDRLEN + MAXNAME + MAXLOGDC ];
+    uchar *p = buf;
+    int nl = strlen(l->name);
+    int dl = strlen(l->datacenter);
 
+    p = put_short(p, LOGBIN_HDRLEN + nl + dl);
+    *p++ = LOGBIN_VERSION;
+    *p++ = l->tcp ? LOGBIN_F_TCP : 0;
+    p = put_long(p, l->when);
+    *p++ = (l->family == AF_INET6) ? 6 : 4;
+    memcpy(p, l->addr, 16);		p += 16;
+    *p++ = l->edns_family;
+    *p++ = l->edns_src;
+    *p++ = l->edns_scope;
+    memcpy(p, l->edns_addr, 16);	p += 16;
+    p = put_short(p, l->klass);
+    p = put_short(p, l->type);
+    p = put_short(p, l->flags);
+    p = put_short(p, l->size);
+    p = put_short(p, l->udpsize);
+    p = put_long(p,  l->mmflags);
+    *p++ = nl;
+    *p++ = dl;
+    memcpy(p, l->name, nl);		p += nl;
+    memcpy(p, l->datacenter, dl);	p += dl;
+
+    fwrite(buf, p - buf, 1, f);
+}
+
+// copy out everything the producers have finished
+static int
+log_drain(FILE *f){
+    int n = 0;
+    bool bin = (config->logformat == "binary");
+
+    ring_lock.lock();
+    LogRing *list = ring_list;
+    ring_lock.unlock();
+
+    for(LogRing *r=list; r; r=r->next){
+        uint32_t t = r->tail;
+        uint32_t h = r->head;
+        MEMBAR();
+
+        for( ; t != h; t++ ){
+            if( !f ) continue;
+            if( bin )
+                log_output_bin(f, r->rec + (t & r->mask));
+            else
+                log_output(f, r->rec + (t & r->mask));
+            n ++;
+        }
+
+        MEMBAR();
+        r->tail = t;
+    }
+
+    return n;
+}
+
+// is the file still the one we have open? (rotated, removed, reconfigured)
+static bool
+log_is_current(FILE *f, const string& file, const string& name){
+    struct stat sf, sn;
+
+    if( file != name ) return 0;
+    if( fstat(fileno(f), &sf) ) return 0;
+    if( stat(name.c_str(), &sn) ) return 0;
+    return sf.st_ino == sn.st_ino && sf.st_dev == sn.st_dev;
+}
+
+static void *
+log_writer(void *){
+    FILE *f = 0;
+    string file;
+    time_t lastcheck = 0;
+    time_t t_retry   = 0;		// cannot open. try again then
+    time_t t_complained = 0;
+    int    backoff   = 1;
+
+    while(1){
+        time_t now = lr_now();
+
+        if( reopen_log || (f && now != lastcheck && !log_is_current(f, file, config->logfile)) ){
+            if( f ) fclose(f);
+            f = 0;
+            t_retry = 0;
+            reopen_log = 0;
+        }
+        lastcheck = now;
+
+        if( !f && !config->logfile.empty() && now >= t_retry ){
+            file = config->logfile;
+            f = fopen(file.c_str(), "a");
+            if( f ){
+                setvbuf(f, 0, _IOFBF, 65536);
+                backoff = 1;
+            }else{
+                // back off. don't flood the diag log
+                if( now >= t_complained + COMPLAINT ){
+                    PROBLEM("cannot open %s: %s", file.c_str(), strerror(errno));
+                    t_complained = now;
+                }
+                t_retry = now + backoff;
+                backoff = MIN(backoff * 2, MAXRETRY);
+            }
+        }
+
+        // NB: records are discarded if there is nowhere to put them
+        int n = log_drain(f);
+
+        if( n && f ) fflush(f);
+        if( !n ) usleep( LOGINTERVAL );
+    }
+}
@@ -37,6 +37,8 @@ void console_init(void);
 void mmdb_init(void);
 void zdb_init(void);
 void mon_init(void);
+void log_init(void);
+void epoch_init(void);
 
 void
 usage(void){
@@ -110,6 +112,7 @@ main(int argc, char **argv){
 	 FATAL("cannot read config file");
      }
 
+     epoch_init();
      mmdb_init();
      zdb_init();
 
@@ -127,6 +130,7 @@ main(int argc, char **argv){
      mon_init();
      console_init();
      dns_init();
+     log_init();
      network_init();
 
 
@@ -165,7 +169,7 @@ reload_config(void *file){
             force_reload = 0;
             VERBOSE("config changed, reloading");
             read_config( (char*)file );
-            load_zdb();
+            load_zdb(1);	// only the changed zones
         }
     }
 }
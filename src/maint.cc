@@ -14,68 +14,37 @@
 #include "lock.h"
 #include "hrtime.h"
 #include "maint.h"
-#include "zdb.h"
-#include "mmd.h"
-#include "lock.h"
+#include "datacenter.h"
 
 #include <stdlib.h>
 
-static MMD   dcm;
-
-static int
-find(const char *dc){
-
-    for(int i=0; i<dcm.nelem; i++){
-        if( ! dcm.mm[i].datacenter ) continue;
-        if( !strcmp(dc, dcm.mm[i].datacenter) ) return i;
-    }
-
-    return -1;
-}
-
-// datacenters are registered when mmdb is loaded
-void
-maint_register(const char *dc){
-
-    int pos = find(dc);
-    if( pos != -1 ) return;	// already got it
-
-    if( dcm.nelem >= MAXMMELEM ){
-        PROBLEM("too many datacenters. cannot add");
-        return;
-    }
-
-    // insert
-    dcm.mm[dcm.nelem].metric = 0;	// mark it as ok
-
-    char *ndc = strdup(dc);
-    ATOMIC_SETPTR(dcm.mm[dcm.nelem ++].datacenter, ndc);
-
-}
+// bit per datacenter id. set = offline for maintenance
+static volatile uint64_t maint = 0;
+static Mutex maint_lock;
 
 
 bool
-maint_get(const char *dc){
-
-    int i = find(dc);
-    if( i == -1 ){
-        DEBUG("%s is ?", dc);
-        return 0;
-    }
+maint_get(int id){
 
-    return dcm.mm[i].metric;
+    if( id < 0 ) return 0;
+    return (maint >> id) & 1;
 }
 
 bool
 maint_set(const char *dc, bool status){
 
-    int i = find(dc);
-    if( i == -1 ){
+    int id = dc_id(dc);
+    if( id < 0 ){
         DEBUG("invalid datacenter %s", dc);
         return 0;
     }
 
-    dcm.mm[i].metric = status;
+    maint_lock.lock();
+    if( status )
+        maint |= 1ULL << id;
+    else
+        maint &= ~(1ULL << id);
+    maint_lock.unlock();
 
     if( status ){
         DEBUG("offline maint %s", dc);
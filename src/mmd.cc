@@ -14,11 +14,13 @@
 #include "mmd.h"
 #include "network.h"
 #include "thread.h"
-#include "maint.h"
+#include "datacenter.h"
+#include "epoch.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -28,8 +30,11 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <queue>
+
 
 static MMDB mmdb;
+static uint32_t mmdb_gen = 0;
 
 
 static void*
@@ -87,8 +92,7 @@ MMDB::load_ipv4(void){
 
     if( old ){
         VERBOSE("reloaded ipv4 mm data");
-        sleep(5);
-        delete old;
+        epoch_retire(old);
     }
 
     return 1;
@@ -111,8 +115,7 @@ MMDB::load_ipv6(void){
 
     if( old ){
         VERBOSE("reloaded ipv6 mm data");
-        sleep(5);
-        delete old;
+        epoch_retire(old);
     }
 
     return 1;
@@ -125,17 +128,11 @@ MMDB::load_ipv6(void){
 bool
 MMDB::datacenter_valid(const char *dc){
 
-    if( mmdb.ipv4 && mmdb.ipv4->datacenter_valid(dc) ) return 1;
-    if( mmdb.ipv6 && mmdb.ipv6->datacenter_valid(dc) ) return 1;
-    return 0;
-}
-
-bool
-MMDB_File::datacenter_valid(const char *dcn) const{
+    int id = dc_id(dc);
+    if( id < 0 ) return 0;
 
-    for(int i=0; i<hdr->n_datacenter; i++){
-        if( !strcmp(dc[i], dcn) ) return 1;
-    }
+    if( mmdb.ipv4 && mmdb.ipv4->datacenter_valid(id) ) return 1;
+    if( mmdb.ipv6 && mmdb.ipv6->datacenter_valid(id) ) return 1;
     return 0;
 }
 
@@ -195,14 +192,23 @@ MMDB_File::load(const char *file){
 
     file_mtime = sb.st_mtime;
     file_inum  = sb.st_ino;
+    gen        = ++ mmdb_gen;
     map_start  = mm;
     map_size   = size;
     hdr        = (MMDFile_Hdr*)map_start;
 
-    if( hdr->magic != MMDDATAMAGIC || hdr->version != MMDDATAVERSION ){
+    if( hdr->magic != MMDDATAMAGIC || hdr->version < 1 || hdr->version > MMDDATAVERSION ){
         PROBLEM("corrupt datafile (magic %X)", hdr->magic);
         return 0;
     }
+    if( hdr->n_datacenter < 0 || hdr->n_datacenter > MAXMMELEM ){
+        PROBLEM("corrupt datafile (%d datacenters)", (int)hdr->n_datacenter);
+        return 0;
+    }
+    if( hdr->version >= 2 && hdr->rec_size < (int)(sizeof(MMDFile_Rec) + hdr->n_datacenter * (sizeof(int32_t) + 1)) ){
+        PROBLEM("corrupt datafile (rec size %d)", hdr->rec_size);
+        return 0;
+    }
 
     // RSN - more validation
 
@@ -214,12 +220,15 @@ MMDB_File::load(const char *file){
     // init datacenter list
     const char *dcs = (char*)map_start + hdr->datacenter_start;
     for(int i=0; i<hdr->n_datacenter; i++){
-        dc[i] = dcs;
-        maint_register( dcs );
+        dcid[i] = dc_register( dcs );
+        if( dcid[i] >= 0 ) dcmask |= 1ULL << dcid[i];
         DEBUG("datacenter %d => %s", i, dcs);
         while( *dcs ++ ){}
     }
 
+    if( hdr->ipver == 4 && config->ipv4_index ) build_index();
+    if( hdr->ipver == 6 && config->ipv6_index ) build_eytz();
+
 #if 0
     for(int i=0; i<hdr->n_recs; i++){
         const MMDFile_Rec *r = get_rec(i);
@@ -232,6 +241,10 @@ MMDB_File::load(const char *file){
 
 MMDB_File::~MMDB_File(){
 
+    free(idx24);
+    free(idx8);
+    free(ekey);
+
     int i = munmap((char*)map_start, map_size);
     if( i == -1 ){
         PROBLEM("error unmapping datafile: %s", strerror(errno));
@@ -276,7 +289,28 @@ MMDB_File::locate(NTD *ntd, const uchar *addr) const {
           addr[0], addr[1], addr[2], addr[3],
           addr[4], addr[5], addr[6], addr[7]);
 
-    const MMDFile_Rec *fb = best_rec(addr);
+    const MMDFile_Rec *fb = 0;
+    MMCache_Ent *ce = 0;
+    bool hit = 0;
+
+    // NB: the ipv4 index is already as fast as the cache
+    if( config->location_cache && !idx24 ){
+        if( !ntd->mmcache ) ntd->mmcache = new MMCache( config->location_cache );
+        hit = cache_get(ntd->mmcache, addr, &fb, &ce);
+    }
+
+    if( hit ){
+        INCSTAT(ntd, n_mmcache_hit);
+    }else{
+        bool uniform;
+        fb = find_rec(addr, ce ? &uniform : 0);
+
+        if( ce ){
+            INCSTAT(ntd, n_mmcache_miss);
+            cache_put(ntd->mmcache, ce, addr, fb, uniform);
+        }
+    }
+
     if( !fb ) return 0;
 
     DEBUG("found %02x%02x%02x%02x.%02x%02x%02x%02x /%d f=%d",
@@ -286,52 +320,413 @@ MMDB_File::locate(NTD *ntd, const uchar *addr) const {
 
     if( fb->flags & MMDFREC_FLAG_UNKNOWN ) return 0;
 
-    // copy data
-    for(int i=0; i<hdr->n_datacenter; i++){
-        ntd->mmd.mm[i].datacenter = dc[i];
-        ntd->mmd.mm[i].metric     = fb->metric[i];
-        DEBUG("  %s => %d", dc[i], fb->metric[i]);
+    int nd = hdr->n_datacenter;
+    MMElem *mme = ntd->mmd.mm;
+
+    if( hdr->version >= 2 ){
+        // copy data, best first
+        const uchar *rank = (const uchar*)(fb->metric + nd);
+
+        for(int k=0; k<nd; k++){
+            int i = rank[k];
+            if( i >= nd ) i = k;	// corrupt. don't crash
+            mme[k].dcid   = dcid[i];
+            mme[k].metric = fb->metric[i];
+            DEBUG("  %s => %d", dc_name(dcid[i]), fb->metric[i]);
+        }
+        ntd->mmd.ranked = 1;
+    }else{
+        // copy data
+        for(int i=0; i<nd; i++){
+            mme[i].dcid   = dcid[i];
+            mme[i].metric = fb->metric[i];
+            DEBUG("  %s => %d", dc_name(dcid[i]), fb->metric[i]);
+        }
     }
 
-    ntd->mmd.nelem = hdr->n_datacenter;
+    ntd->mmd.nelem = nd;
     ntd->edns.scope_masklen = fb->masklen;
 
     return 1;
 }
 
+static inline uint64_t
+rec_key(const uchar *a, int len){
+    uint64_t k = 0;
+
+    for(int i=0; i<len; i++) k = (k << 8) | a[i];
+    return k;
+}
+
+// a block covers 2^(bits - masklen) addrs, starting at addr
+bool
+MMDB_File::rec_contains(const MMDFile_Rec *r, uint64_t a) const {
+    int bits = addr_size * 8;
+    int span = bits - r->masklen;
+
+    uint64_t s = rec_key(r->addr, addr_size);
+
+    if( a < s ) return 0;
+    if( span >= 64 ) return 1;
+    if( span <= 0 )  return a == s;
+    return ((a - s) >> span) == 0;
+}
+
+// find the block containing addr, and whether every addr in its cache
+// prefix would get the same answer
 const MMDFile_Rec *
-MMDB_File::best_rec(const uchar *addr) const {
+MMDB_File::find_rec(const uchar *addr, bool *uniform) const {
+
+    if( idx24 ) return index_rec(addr);
+
+    uint64_t x = rec_key(addr, addr_size);
+    int u = rec_upper(x);
+
+    if( uniform ) *uniform = prefix_uniform(x, u);
+
+    // does the block on the left contain the target?
+    // NB: only finds the enclosing block if blocks do not overlap
+    if( !u ) return 0;
+
+    const MMDFile_Rec *r = get_rec(u - 1);
+    return rec_contains(r, x) ? r : 0;
+}
+
+// first rec with addr > x. on a tie, the later block wins, same as the ipv4 index
+int
+MMDB_File::rec_upper(uint64_t x) const {
+
+    if( ekey ) return eytz_upper(x);
 
     // binary search
-    int f=0, l=hdr->n_recs-1;
+    int f=0, l=hdr->n_recs;
     DEBUG("bsearch %d - %d recs, as %d, rs %d", f, l, addr_size, hdr->rec_size);
 
-    while(f <= l){
+    while( f < l ){
         int m = (f+l)/2;
-        const MMDFile_Rec *r = get_rec(m);
-        int s = memcmp(addr, r->addr, addr_size);
+        if( rec_key(get_rec(m)->addr, addr_size) <= x )
+            f = m + 1;		// move right
+        else
+            l = m;		// move left
+    }
+    return f;
+}
+
+//################################################################
+
+// DIR-24-8 (Gupta, Lin, McKeown): the first 24 bits index a 2^24 table.
+// a /24 that is split up gets a chunk: a 256 bit map of where each run
+// starts, followed by the runs (poptrie style), usually one cache line.
+// the longest (most specific) block wins, ties go to the later block
+
+class MMDIdx_Build {
+public:
+    uint32_t	*chunk;
+    int		nchunk;
+    int		len;		// words used
+    int		size;
+    uint32_t	cur[256];	// the /24 being split
+
+    MMDIdx_Build(){ chunk = 0; nchunk = 0; len = 0; size = 0; }
+};
+
+static inline int
+popcount32(uint32_t v){
+#ifdef __GNUC__
+    return __builtin_popcount(v);
+#else
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+#endif
+}
 
-        if( s > 0 )      f = m + 1;     // move right
-        else if( s < 0 ) l = m - 1;     // move left
-        else return r;		        // found exact
+void
+MMDB_File::build_index(void){
+    int nrec = hdr->n_recs;
+    MMDIdx_Build b;
+    // active blocks, by (masklen, rec#)
+    std::priority_queue< std::pair<int,int> > active;
+
+    idx24 = (uint32_t*)calloc(1 << 24, sizeof(uint32_t));
+    if( !idx24 ){
+        PROBLEM("cannot allocate ipv4 index, using binary search");
+        return;
+    }
+
+    // sweep across the address space, emitting runs of the same answer
+    // NB: recs are sorted by addr
+    uint64_t x = 0;
+    int i = 0;
+
+    while( x <= 0xFFFFFFFFULL ){
+        for( ; i < nrec && rec_key(get_rec(i)->addr, 4) <= x; i++ ){
+            int ml = get_rec(i)->masklen;
+            if( ml < 0 || ml > 32 ) continue;
+            active.push( std::make_pair(ml, i) );
+        }
+        while( !active.empty() && rec_end(active.top().second) < x )
+            active.pop();
+
+        uint64_t next = (i < nrec) ? rec_key(get_rec(i)->addr, 4) : 0x100000000ULL;
+        uint32_t val  = 0;
+
+        if( !active.empty() ){
+            int r = active.top().second;
+            if( rec_end(r) + 1 < next ) next = rec_end(r) + 1;
+            val = r + 1;
+        }
+
+        if( ! index_range(&b, x, next - 1, val) ){
+            PROBLEM("cannot allocate ipv4 index, using binary search");
+            free(idx24);
+            free(b.chunk);
+            idx24 = 0;
+            return;
+        }
+        x = next;
     }
 
-    // close match?
-    if( l >= 0 && l < hdr->n_recs ){
-        const MMDFile_Rec *r = get_rec(l);	// block on the left
-        int masklen = r->masklen;
-
-        // does the found block contain the target?
-        // only a loose check, better to have a bad answer than none at all
-        if( r->addr[0] != addr[0] ) return 0;
-        if( masklen >= 16 && r->addr[1] != addr[1] ) return 0;
-        if( addr_size > 4 ){
-            // ipv6:
-            if( masklen >= 24 && r->addr[2] != addr[2] ) return 0;
-            if( masklen >= 32 && r->addr[3] != addr[3] ) return 0;
+    idx8   = b.chunk;
+    n_idx8 = b.len;
+
+    VERBOSE("ipv4 index: %d recs, %d chunks, %lld MB", nrec, b.nchunk,
+            (((1LL << 24) + n_idx8) * sizeof(uint32_t)) >> 20);
+}
+
+// last addr in the block
+uint64_t
+MMDB_File::rec_end(int n) const {
+    const MMDFile_Rec *r = get_rec(n);
+    uint64_t start = rec_key(r->addr, 4);
+
+    return start + (0xFFFFFFFFULL >> r->masklen);
+}
+
+// addrs start - end => val. called in order, covering everything
+int
+MMDB_File::index_range(MMDIdx_Build *b, uint64_t start, uint64_t end, uint32_t val){
+
+    if( end > 0xFFFFFFFFULL ) end = 0xFFFFFFFFULL;
+
+    while( start <= end ){
+        uint32_t i  = start >> 8;
+        int lo = start & 0xFF;
+        int hi = (end >> 8 == i) ? (end & 0xFF) : 0xFF;
+
+        if( lo == 0 && hi == 0xFF ){
+            // whole /24s
+            uint32_t ei = (end & 0xFF) == 0xFF ? end >> 8 : (end >> 8) - 1;
+            for( ; i <= ei; i++ ) idx24[i] = val;
+            start = (uint64_t)i << 8;
+            continue;
+        }
+
+        for(int j=lo; j<=hi; j++) b->cur[j] = val;
+        start = ((uint64_t)i << 8) + hi + 1;
+
+        if( hi != 0xFF ) continue;
+
+        // finished a split /24, compress it
+        int nrun = 1;
+        for(int j=1; j<256; j++) if( b->cur[j] != b->cur[j-1] ) nrun ++;
+
+        if( nrun == 1 ){
+            idx24[i] = b->cur[0];
+            continue;
         }
-        return r;
+
+        if( b->len + 8 + nrun > b->size ){
+            int sz = b->size ? b->size * 2 : 65536;
+            uint32_t *n = (uint32_t*)realloc(b->chunk, sz * sizeof(uint32_t));
+            if( !n ) return 0;
+            b->chunk = n;
+            b->size  = sz;
+        }
+
+        uint32_t *c = b->chunk + b->len;
+        memset(c, 0, 8 * sizeof(uint32_t));
+        int n = 0;
+        for(int j=0; j<256; j++){
+            if( j && b->cur[j] == b->cur[j-1] ) continue;
+            c[ j >> 5 ] |= 1 << (j & 31);
+            c[ 8 + n ++ ] = b->cur[j];
+        }
+
+        idx24[i] = MMDIDX_CHUNK | b->len;
+        b->len += 8 + nrun;
+        b->nchunk ++;
     }
 
-    return 0;   // not found
+    return 1;
+}
+
+const MMDFile_Rec *
+MMDB_File::index_rec(const uchar *addr) const {
+    uint32_t e = idx24[ (addr[0] << 16) | (addr[1] << 8) | addr[2] ];
+
+    if( e & MMDIDX_CHUNK ){
+        const uint32_t *c = idx8 + (e & ~MMDIDX_CHUNK);
+        int w = addr[3] >> 5;
+        // runs started at or before addr
+        int n = popcount32( c[w] & (0xFFFFFFFF >> (31 - (addr[3] & 31))) );
+        for(int j=0; j<w; j++) n += popcount32( c[j] );
+        e = c[ 8 + n - 1 ];
+    }
+
+    return e ? get_rec(e - 1) : 0;
+}
+
+//################################################################
+
+// eytzinger layout (Khuong + Morin): the sorted keys laid out as an
+// implicit binary tree in bfs order. the top of the tree shares a few
+// cache lines, and the next levels can be prefetched
+
+void
+MMDB_File::build_eytz(void){
+    int nrec = hdr->n_recs;
+
+    // NB: 64 byte aligned, so 8 siblings share a cache line
+    if( posix_memalign((void**)&ekey, 64, (nrec + 1) * sizeof(uint64_t)) ){
+        PROBLEM("cannot allocate ipv6 index, using binary search");
+        ekey = 0;
+        return;
+    }
+
+    eytz_fill(0, 1);
+
+    for(eytz_h=0; (2 << eytz_h) <= nrec; eytz_h++) ;
+    eytz_l = nrec - ((1 << eytz_h) - 1);
+
+    VERBOSE("ipv6 index: %d recs, %lld MB", nrec, ((nrec + 1LL) * sizeof(uint64_t)) >> 20);
+}
+
+// in-order walk of the implicit tree, assigning sorted recs
+int
+MMDB_File::eytz_fill(int i, int k){
+
+    if( k > hdr->n_recs ) return i;
+
+    i = eytz_fill(i, 2 * k);
+    ekey[k] = rec_key(get_rec(i)->addr, addr_size);
+    i ++;
+    return eytz_fill(i, 2 * k + 1);
+}
+
+// rank of the first key > x, n if none
+int
+MMDB_File::eytz_upper(uint64_t x) const {
+    uint32_t n = hdr->n_recs;
+    uint32_t k = 1;
+    int d = 0;
+
+    while( k <= n ){
+        PREFETCH( ekey + 8 * k );	// 3 levels down
+        k = 2 * k + (ekey[k] <= x);
+        d ++;
+    }
+    // undo the right turns taken after the last left
+    int s = ffs(~k);
+    k >>= s;
+    d -= s;
+
+    if( !k ) return n;
+
+    // rank of node k: exact for a full tree, less the missing
+    // last level nodes that sort before it
+    int r = ((2 * (k - (1 << d)) + 1) << (eytz_h - d)) - 1;
+    int m = (r + 1) / 2 - eytz_l;
+    if( m > 0 ) r -= m;
+    return r;
+}
+
+//################################################################
+
+MMCache::MMCache(int n){
+    int sz = 1;
+
+    while( sz < n ) sz <<= 1;
+    ent  = (MMCache_Ent*)calloc(sz, sizeof(MMCache_Ent));
+    mask = sz - 1;
+}
+
+MMCache::~MMCache(){
+    free(ent);
+}
+
+// look in the per thread cache: by the client's /24 (/48) if every addr in it
+// gets the same answer, otherwise by the full addr.
+// on a miss, returns the slot for cache_put
+bool
+MMDB_File::cache_get(MMCache *c, const uchar *addr, const MMDFile_Rec **fb, MMCache_Ent **slot) const {
+    int bits  = addr_size * 8;
+    int pbits = (addr_size == 4) ? MMCACHE_BITS4 : MMCACHE_BITS6;
+    uint64_t a = rec_key(addr, addr_size);
+    uint64_t k = a >> (bits - pbits);
+
+    MMCache_Ent *e = c->get(k, pbits);
+
+    if( e->gen != gen || e->key != k || e->bits != pbits ){
+        e->key  = k;
+        e->bits = pbits;
+        e->gen  = 0;
+        *slot   = e;
+        return 0;
+    }
+    if( !e->split ){
+        *fb = e->rec;
+        return 1;
+    }
+
+    e = c->get(a, bits);
+
+    if( e->gen == gen && e->key == a && e->bits == bits ){
+        *fb = e->rec;
+        return 1;
+    }
+
+    e->key  = a;
+    e->bits = bits;
+    e->gen  = 0;
+    *slot   = e;
+    return 0;
+}
+
+void
+MMDB_File::cache_put(MMCache *c, MMCache_Ent *e, const uchar *addr, const MMDFile_Rec *fb, bool uniform) const {
+    int bits = addr_size * 8;
+
+    if( e->bits != bits && !uniform ){
+        // split prefix. remember that, and cache the addr instead
+        e->split = 1;
+        e->rec   = 0;
+        e->gen   = gen;
+
+        uint64_t a = rec_key(addr, addr_size);
+        e = c->get(a, bits);
+        e->key  = a;
+        e->bits = bits;
+    }
+
+    e->split = 0;
+    e->rec   = fb;
+    e->gen   = gen;
+}
+
+// given u = rec_upper(x): does every addr in x's cache prefix get the same answer?
+bool
+MMDB_File::prefix_uniform(uint64_t x, int u) const {
+    int span = addr_size * 8 - ((addr_size == 4) ? MMCACHE_BITS4 : MMCACHE_BITS6);
+    uint64_t ps = (x >> span) << span;
+    uint64_t pe = ps | ((1ULL << span) - 1);
+
+    // no block may start inside the prefix
+    if( u > 0 && rec_key(get_rec(u - 1)->addr, addr_size) > ps ) return 0;
+    if( u < hdr->n_recs && rec_key(get_rec(u)->addr, addr_size) <= pe ) return 0;
+    if( !u ) return 1;
+
+    // and the block on the left covers all or none of it
+    const MMDFile_Rec *r = get_rec(u - 1);
+    return rec_contains(r, ps) == rec_contains(r, pe);
 }
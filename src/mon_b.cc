@@ -30,16 +30,21 @@
 #include <sys/wait.h>
 #include <errno.h>
 
+#include <map>
+using std::map;
+
 
 #define MAXFAILS	2
 #define MAXRUNNING	20
 #define TIMEOUT		30
 
 static int running = 0;
+static vector<Monitor*> probes;		// ours. by uid, no dupes
+static string cmdbuf;			// from the parent
 
 inline bool
 Monitor::too_long(time_t now) const{
-    return pid && t_started + TIMEOUT < now;
+    return is_running() && t_timeout < now;
 }
 
 void
@@ -50,6 +55,11 @@ Monitor::maybe_start(time_t now){
 void
 Monitor::start(time_t now){
 
+    if( is_native() ){
+        start_native(now);
+        return;
+    }
+
     if( running >= MAXRUNNING ){
         t_next += 2;
         return;
@@ -65,7 +75,10 @@ Monitor::start(time_t now){
     if( p ){
         // parent
         t_last = t_started = now;
+        hr_started = hr_now();
+        t_timeout = now + TIMEOUT;
         pid    = p;
+        running ++;
         DEBUG("started mon %s pid %d", prog.c_str(), p);
         return;
     }
@@ -92,33 +105,45 @@ Monitor::start(time_t now){
 }
 
 void
-Monitor::set_status(bool st, int idx){
+Monitor::set_status(bool st){
+    ProbeSlot *sl = mon_slots + uid;
+    bool was = status;
 
     if( st ){
-        if( ++fail_count <= MAXFAILS ) return;
-        status = 0;
-
+        if( ++fail_count > MAXFAILS ) status = 0;
     }else{
         status = 1;
         fail_count = 0;
     }
 
     // tell parent process
-    // NB: stdout is a pipe connected to the console
-    DEBUG("send status %d %d %d", idx, uid, status);
-    printf("probestatus %d %d %d\n", idx, uid, status);
-    fflush(stdout);
+    // readers retry if seq is odd, or changes
+    sl->seq ++;
+    MEMBAR();
+    sl->status  = status;
+    sl->fails   = fail_count;
+    sl->latency = (hr_now() - hr_started) / 1000;
+    sl->t_check = lr_now();
+    sl->checks ++;
+    MEMBAR();
+    sl->seq ++;
+
+    DEBUG("probe %d status %d", uid, status);
+    if( status != was )
+        VERBOSE("%s %s is %s", prog.c_str(), address.c_str(), status ? "UP" : "DOWN");
+}
 
-    // (non-blockingly) empty the buffer of any recvd data
-    char buf[16];
-    fcntl(1, F_SETFL, O_NDELAY);
-    read(1, buf, sizeof(buf));
-    fcntl(1, F_SETFL, 0);
+// pick up where the last mon process left off
+void
+Monitor::resume(void){
+    const ProbeSlot *sl = mon_slots + uid;
 
+    status     = sl->status;
+    fail_count = sl->fails;
 }
 
 void
-Monitor::wait(int idx, time_t now){
+Monitor::wait(time_t now){
     int status = 1;
 
     int w = waitpid(pid, &status, WNOHANG);
@@ -129,22 +154,140 @@ Monitor::wait(int idx, time_t now){
     pid = 0;
     running --;
 
-    // update status
-    set_status(status, idx);
+    done(now, status);
+}
+
+// update status, reschedule
+void
+Monitor::done(time_t now, bool st){
+
+    set_status(st);
 
-    // reschedule
     t_next += freq;
     if( t_next <= now )
         t_next = now + random() % freq;
-
 }
 
 void
 Monitor::abort(){
+
+    if( fd != -1 ){
+        DEBUG("probe %s %s timed out", prog.c_str(), address.c_str());
+        finish(lr_now(), 1);
+        return;
+    }
+
     DEBUG("killing pid %d", pid);
     kill( pid, (kills++ > 2) ? 9 : 15 );
 }
 
+// removed by a reload
+void
+Monitor::stop(){
+
+    if( fd != -1 ) cancel();
+    if( !pid ) return;
+    DEBUG("stopping pid %d", pid);
+    kill( pid, 9 );
+    waitpid( pid, 0, 0 );
+    pid = 0;
+    running --;
+}
+
+//################################################################
+
+// add uid freq address prog args (tab separated)
+static void
+probe_add(const string *cmd){
+    int uid = 0;
+    string f[4];
+
+    int s = 4;
+    for(int i=0; i<5; i++){
+        int e = (i == 4) ? cmd->length() : cmd->find('\t', s);
+        if( e == -1 ){
+            PROBLEM("invalid probe update: %s", cmd->c_str());
+            return;
+        }
+        if( i == 0 )
+            uid = atoi( cmd->c_str() + s );
+        else
+            f[i-1].assign( *cmd, s, e - s );
+        s = e + 1;
+    }
+
+    if( uid < 0 || uid >= MAXPROBES ){
+        PROBLEM("invalid probe update: %s", cmd->c_str());
+        return;
+    }
+    for(int i=0; i<(int)probes.size(); i++){
+        if( probes[i]->uid == uid ) return;
+    }
+
+    Monitor *m = new Monitor( atoi(f[0].c_str()), &f[1], &f[2], &f[3] );
+    m->uid = uid;
+    m->resume();
+    probes.push_back(m);
+    DEBUG("added probe %d %s", uid, m->key.c_str());
+}
+
+static void
+probe_del(int uid){
+
+    if( uid < 0 || uid >= MAXPROBES ) return;
+
+    for(int i=0; i<(int)probes.size(); i++){
+        Monitor *m = probes[i];
+        if( m->uid != uid ) continue;
+
+        m->stop();
+        probes.erase( probes.begin() + i );
+        delete m;
+        DEBUG("removed probe %d", uid);
+        break;
+    }
+
+    // we will not write it again. the parent may reuse it
+    ProbeSlot *sl = mon_slots + uid;
+    MEMBAR();
+    sl->done = sl->gen;
+}
+
+// read + apply any updates from the parent
+static void
+read_updates(void){
+    char buf[4096];
+
+    while(1){
+        int r = read(0, buf, sizeof(buf));
+        if( r > 0 ){
+            cmdbuf.append(buf, r);
+            continue;
+        }
+        if( r == 0 ){
+            // parent is gone
+            exit(0);
+        }
+        break;
+    }
+
+    int s = 0;
+    while(1){
+        int e = cmdbuf.find('\n', s);
+        if( e == -1 ) break;
+
+        string cmd(cmdbuf, s, e - s);
+        s = e + 1;
+
+        if( !cmd.compare(0, 4, "add\t") )
+            probe_add( &cmd );
+        else if( !cmd.compare(0, 4, "del ") )
+            probe_del( atoi(cmd.c_str() + 4) );
+    }
+
+    cmdbuf.erase(0, s);
+}
+
 void
 mon_exit(int sig){
     exit(0);
@@ -166,21 +309,43 @@ mon_run(void){
     // close any open files
     for(int i=4; i<256; i++) close(i);
 
+    fcntl(0, F_SETFL, O_NDELAY);
+    mon_native_init();
+
+    // our own copy of the probes, one per uid
+    // later changes come from the parent
+    map<int, bool> seen;
+    for(int i=0; i<(int)zdb->monitored.size(); i++){
+        Monitor *m = zdb->monitored[i]->probe;
+        if( m->uid < 0 || seen[m->uid] ) continue;
+        seen[m->uid] = 1;
+        m = new Monitor(*m);
+        m->resume();
+        probes.push_back( m );
+    }
+
+    time_t last = 0;
     while(1){
+        // builtin probes are handled as their io arrives
+        // everything else, once a second
+        mon_native_poll(1000);
+
         time_t now = lr_now();
-        int len    = zdb->monitored.size();
+        if( now == last ) continue;
+        last = now;
+
+        read_updates();
+
+        int len    = probes.size();
         int rx     = len ? random() % len : 0;
 
         for(int i=0; i<len; i++){
             int n = (i + rx) % len;
-            RR *rr = zdb->monitored[n];
-            if( !rr ) continue;
-            Monitor *mon = rr->probe;
-            if( !mon ) continue;
+            Monitor *mon = probes[n];
 
             if( mon->is_running() ){
                 // finished?
-                mon->wait(n, now);
+                if( !mon->is_native() ) mon->wait(now);
                 // running too long? kill
                 if( mon->too_long(now) ) mon->abort();
             }else{
@@ -188,8 +353,6 @@ mon_run(void){
                 mon->maybe_start(now);
             }
         }
-
-        sleep(1);
     }
 
     exit(0);
@@ -0,0 +1,366 @@
+/*
+  Copyright (c) 2026
+  Author: agent <agent @ local>
+  Created: 2026-Oct-17 19:55 (EDT)
+  Function: service monitoring - builtin probes, run in the mon process
+*/
+
+#define CURRENT_SUBSYSTEM	'M'
+
+#include "defs.h"
+#include "misc.h"
+#include "diag.h"
+#include "config.h"
+#include "hrtime.h"
+#include "dns.h"
+#include "mon.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#  include <sys/epoll.h>
+#  define HAVE_EPOLL
+#endif
+
+#define MAXEVENTS	256
+#define HTTPREAD	128		// enough for the status line
+
+// nstate
+#define NS_CONNECT	0
+#define NS_READ		1
+
+static struct {
+    const char *name;
+    int  kind;
+} montype[] = {
+    { "tcp",	MON_TCP  },	// tcp [port]
+    { "http",	MON_HTTP },	// http [port] [host] [file] [status]
+    { "dns",	MON_DNS  },	// dns [name] [port]
+};
+
+static int efd       = -1;
+static int nrunning  = 0;
+static int maxnative = 0;
+
+// no epoll, no builtins. everything runs a script
+int
+mon_kind(const string *prog){
+#ifdef HAVE_EPOLL
+    for(int i=0; i<(int)ELEMENTSIN(montype); i++){
+        if( !prog->compare(montype[i].name) ) return montype[i].kind;
+    }
+#endif
+    return MON_EXEC;
+}
+
+void
+mon_native_init(void){
+#ifdef HAVE_EPOLL
+    efd = epoll_create1(EPOLL_CLOEXEC);
+    if( efd == -1 )
+        FATAL("cannot create epoll: %s", strerror(errno));
+
+    // we may want lots of sockets
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if( rl.rlim_cur < rl.rlim_max ){
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    // leave some for scripts + pipes
+    maxnative = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 65536) ? 65536 : rl.rlim_cur;
+    maxnative -= 64;
+    DEBUG("max %d builtin probes", maxnative);
+#endif
+}
+
+// wait up to msec for io, handle it
+int
+mon_native_poll(int msec){
+#ifdef HAVE_EPOLL
+    epoll_event ev[MAXEVENTS];
+
+    if( efd == -1 || !nrunning ){
+        usleep( msec * 1000 );
+        return 0;
+    }
+
+    int n = epoll_wait(efd, ev, MAXEVENTS, msec);
+
+    for(int i=0; i<n; i++){
+        Monitor *m = (Monitor*)ev[i].data.ptr;
+        m->io( ev[i].events );
+    }
+    return n;
+#else
+    usleep( msec * 1000 );
+    return 0;
+#endif
+}
+
+//################################################################
+
+static bool
+probe_addr(const string *addr, int port, sockaddr_storage *sa, socklen_t *sl){
+
+    memset(sa, 0, sizeof(*sa));
+
+    sockaddr_in *sa4 = (sockaddr_in*)sa;
+    if( inet_pton(AF_INET, addr->c_str(), &sa4->sin_addr) == 1 ){
+        sa4->sin_family = AF_INET;
+        sa4->sin_port   = htons(port);
+        *sl = sizeof(sockaddr_in);
+        return 1;
+    }
+
+    sockaddr_in6 *sa6 = (sockaddr_in6*)sa;
+    if( inet_pton(AF_INET6, addr->c_str(), &sa6->sin6_addr) == 1 ){
+        sa6->sin6_family = AF_INET6;
+        sa6->sin6_port   = htons(port);
+        *sl = sizeof(sockaddr_in6);
+        return 1;
+    }
+
+    return 0;
+}
+
+// rfc 1035 4.1.1, 4.1.2
+static bool
+dns_query(string *q, int id, const char *name){
+
+    char hdr[12];
+    memset(hdr, 0, sizeof(hdr));
+    hdr[0] = id >> 8;
+    hdr[1] = id;
+    hdr[5] = 1;		// qdcount
+    q->assign(hdr, sizeof(hdr));
+
+    const char *p = name;
+    while( *p ){
+        const char *e = strchr(p, '.');
+        int l = e ? e - p : strlen(p);
+        if( l > MAXLABEL ) return 0;
+        if( !l ) break;
+        q->push_back( l );
+        q->append(p, l);
+        p += l;
+        if( *p ) p ++;
+    }
+    q->push_back( 0 );
+    if( q->length() - sizeof(hdr) > MAXNAME ) return 0;
+
+    char qt[4] = { 0, TYPE_A, 0, CLASS_IN };
+    q->append(qt, 4);
+    return 1;
+}
+
+// status like "200", or a list of prefixes "2,3"
+static bool
+http_status_ok(const char *code, const char *want){
+
+    while( *want ){
+        int l = strcspn(want, ",");
+        if( l && l <= 3 && !strncmp(code, want, l) ) return 1;
+        want += l;
+        if( *want ) want ++;
+    }
+    return 0;
+}
+
+//################################################################
+
+#ifdef HAVE_EPOLL
+
+void
+Monitor::start_native(time_t now){
+    sockaddr_storage sa;
+    socklen_t sl;
+    int port;
+
+    if( nrunning >= maxnative ){
+        t_next += 1;
+        return;
+    }
+
+    switch(kind){
+    case MON_TCP:	port = atoi(arg(0, "80")); break;
+    case MON_HTTP:	port = atoi(arg(0, "80")); break;
+    case MON_DNS:	port = atoi(arg(1, "53")); break;
+    default:		port = 0;
+    }
+
+    t_last = t_started = now;
+    hr_started = hr_now();
+
+    if( !probe_addr(&address, port, &sa, &sl) ){
+        PROBLEM("cannot probe %s: invalid address", address.c_str());
+        done(now, 1);
+        return;
+    }
+
+    nbuf.clear();
+    if( kind == MON_DNS ){
+        qid = random() & 0xFFFF;
+        if( !dns_query(&nbuf, qid, arg(0, ".")) ){
+            PROBLEM("cannot probe %s: invalid name %s", address.c_str(), arg(0, "."));
+            done(now, 1);
+            return;
+        }
+    }
+
+    fd = socket(sa.ss_family, (kind == MON_DNS ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if( fd == -1 ){
+        PROBLEM("cannot create socket: %s", strerror(errno));
+        t_next += 1;
+        return;
+    }
+
+    nrunning ++;
+    t_timeout = now + MIN(freq, config->mon_timeout);
+    nstate    = NS_CONNECT;
+
+    int c = connect(fd, (sockaddr*)&sa, sl);
+    if( c == -1 && errno != EINPROGRESS ){
+        DEBUG("connect %s failed: %s", address.c_str(), strerror(errno));
+        finish(now, 1);
+        return;
+    }
+
+    epoll_event ev;
+    ev.events   = EPOLLOUT;
+    ev.data.ptr = this;
+
+    if( kind == MON_DNS ){
+        // udp is connected already. send + wait for the answer
+        if( send(fd, nbuf.data(), nbuf.length(), MSG_NOSIGNAL) != (ssize_t)nbuf.length() ){
+            finish(now, 1);
+            return;
+        }
+        ev.events = EPOLLIN;
+        nstate    = NS_READ;
+    }
+
+    if( epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == -1 ){
+        PROBLEM("epoll_ctl failed: %s", strerror(errno));
+        finish(now, 1);
+        return;
+    }
+
+    DEBUG("started probe %s %s", prog.c_str(), address.c_str());
+}
+
+void
+Monitor::io(int events){
+    time_t now = lr_now();
+    char buf[MAXUDPEXT];
+    epoll_event ev;
+
+    if( nstate == NS_CONNECT ){
+        int err = 0;
+        socklen_t l = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &l);
+
+        if( err || (events & EPOLLERR) ){
+            DEBUG("connect %s failed: %s", address.c_str(), strerror(err));
+            finish(now, 1);
+            return;
+        }
+        if( kind == MON_TCP ){
+            finish(now, 0);
+            return;
+        }
+
+        // http. the request is small, it will fit in the socket buffer
+        nbuf  = "GET ";
+        nbuf += arg(2, "/robots.txt");
+        nbuf += " HTTP/1.0\r\nHost: ";
+        nbuf += arg(1, address.c_str());
+        nbuf += "\r\nUser-Agent: ginsing/dns monitor\r\nConnection: close\r\nAccept: */*\r\n\r\n";
+
+        if( send(fd, nbuf.data(), nbuf.length(), MSG_NOSIGNAL) != (ssize_t)nbuf.length() ){
+            finish(now, 1);
+            return;
+        }
+
+        nbuf.clear();
+        nstate      = NS_READ;
+        ev.events   = EPOLLIN;
+        ev.data.ptr = this;
+        epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev);
+        return;
+    }
+
+    int r = recv(fd, buf, sizeof(buf), 0);
+    if( r == -1 && (errno == EAGAIN || errno == EINTR) ) return;
+
+    if( kind == MON_DNS ){
+        // ours? a valid response?
+        if( r < 12 ){
+            finish(now, 1);
+            return;
+        }
+        int id    = ((uchar)buf[0] << 8) | (uchar)buf[1];
+        int flags = ((uchar)buf[2] << 8) | (uchar)buf[3];
+        if( id != qid ) return;		// stray. keep waiting
+
+        int rcode = (flags >> RCODE_SHIFT) & RCODE_MASK;
+        DEBUG("dns %s: rcode %d", address.c_str(), rcode);
+        finish(now, !(flags & FLAG_RESPONSE) || (rcode != RCODE_OK && rcode != RCODE_NX));
+        return;
+    }
+
+    // http. HTTP/1.x NNN ...
+    if( r > 0 ) nbuf.append(buf, r);
+    if( r > 0 && (int)nbuf.length() < HTTPREAD && nbuf.find('\n') == string::npos ) return;
+
+    bool ok = 0;
+    if( nbuf.length() >= 12 && !nbuf.compare(0, 7, "HTTP/1.") && nbuf[8] == ' ' )
+        ok = http_status_ok( nbuf.c_str() + 9, arg(3, "2,3") );
+
+    DEBUG("http %s: %.12s", address.c_str(), nbuf.c_str());
+    finish(now, !ok);
+}
+
+#else
+
+void
+Monitor::start_native(time_t now){
+}
+
+void
+Monitor::io(int events){
+}
+
+#endif
+
+// close up, report status
+void
+Monitor::finish(time_t now, bool st){
+
+    cancel();
+    done(now, st);
+}
+
+// removed by a reload
+// NB: a script being started may briefly hold a copy of the socket,
+// so close alone may not remove it from epoll
+void
+Monitor::cancel(){
+
+#ifdef HAVE_EPOLL
+    epoll_ctl(efd, EPOLL_CTL_DEL, fd, 0);
+#endif
+    close(fd);
+    fd = -1;
+    nrunning --;
+    nbuf.clear();
+}
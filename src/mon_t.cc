@@ -15,6 +15,7 @@
 #include "hrtime.h"
 #include "runmode.h"
 #include "thread.h"
+#include "zdb.h"
 #include "mon.h"
 
 #include <sys/socket.h>
@@ -25,28 +26,56 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <errno.h>
 
+#include <map>
+using std::map;
+
+#define MAXSPIN		100
+
 static int restart_requested = 0;
 static int monpid  = 0;
 
+// the mon process is told about probes added + removed by a reload
+static Mutex monlock;			// mon_start vs mon_reload
+static int   monfd = -1;		// pipe to its stdin
+static map<int, string> probing;	// uid -> key, what it is running
+
+// slots. created before the mon process is forked, kept across restarts
+ProbeSlot *mon_slots = 0;
+static int nslots    = 0;		// used so far
+static vector<int> slotfree;
+static vector<int> slotquar;		// removed. free once the mon process is done with them
+
 static void *mon_manage(void*);
 extern void mon_run(void);
-extern void *console_run(void*);
+extern int mon_kind(const string *);
 
 Monitor::Monitor(int f, string *ad, string *p, string *a){
 
     freq       = f;
     prog       = *p;
+    kind       = mon_kind(p);
+    fd         = -1;
+    nstate     = 0;
+    qid        = 0;
+    t_timeout  = 0;
     address    = *ad;
     fail_count = 0;
     pid        = 0;
-    uid        = random();
+    kills      = 0;
+    uid        = -1;		// mon_carry_over assigns
     status     = 1;
     t_last     = 0;
     t_started  = 0;
+    hr_started = 0;
     t_next     = lr_now() + random() % freq;
 
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", freq);
+    key = string(buf) + '\t' + address + '\t' + prog + '\t' + *a;
+
     // split args
     // RSN - handle ""s, etc?
     int s = 0, e = 0;
@@ -64,6 +93,215 @@ mon_restart(void){
     restart_requested = 1;
 }
 
+static void
+slot_init(void){
+
+    void *p = mmap(0, MAXPROBES * sizeof(ProbeSlot), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    if( p == MAP_FAILED )
+        FATAL("cannot create probe table: %s", strerror(errno));
+
+    mon_slots = (ProbeSlot*)p;
+}
+
+static int
+slot_alloc(void){
+    int n;
+
+    if( !slotfree.empty() ){
+        n = slotfree.back();
+        slotfree.pop_back();
+    }else if( nslots < MAXPROBES ){
+        n = nslots ++;
+    }else{
+        return -1;
+    }
+
+    // not in use by the mon process. no one else writes it
+    ProbeSlot *sl = mon_slots + n;
+    sl->gen ++;
+    sl->seq ++;
+    MEMBAR();
+    sl->status  = 1;
+    sl->latency = 0;
+    sl->fails   = 0;
+    sl->t_check = 0;
+    sl->checks  = 0;
+    MEMBAR();
+    sl->seq ++;
+
+    return n;
+}
+
+// by key, give the new zdb's probes the slots of the old ones, so
+// they keep their status. probes with the same key share a slot,
+// the mon process runs it once
+void
+mon_carry_over(const vector<RR*> *old, const vector<RR*> *nw){
+    map<string, int> prev, cur;
+
+    // the first load happens before anything is forked
+    if( !mon_slots ) slot_init();
+
+    for(int i=0; old && i<(int)old->size(); i++){
+        Monitor *m = (*old)[i]->probe;
+        if( m->uid >= 0 ) prev[ m->key ] = m->uid;
+    }
+
+    monlock.lock();
+
+    // reuse removed slots once the mon process has stopped writing them:
+    // it has confirmed the del, or it is not running
+    for(int i=0; i<(int)slotquar.size(); ){
+        ProbeSlot *sl = mon_slots + slotquar[i];
+
+        if( monfd == -1 || sl->done == sl->gen ){
+            slotfree.push_back( slotquar[i] );
+            slotquar[i] = slotquar.back();
+            slotquar.pop_back();
+        }else{
+            i ++;
+        }
+    }
+
+    int kept = 0, full = 0;
+    for(int i=0; i<(int)nw->size(); i++){
+        Monitor *m = (*nw)[i]->probe;
+        map<string, int>::iterator it = cur.find( m->key );
+
+        if( it == cur.end() ){
+            it = prev.find( m->key );
+            if( it != prev.end() ){
+                m->uid = it->second;
+                kept ++;
+            }else{
+                m->uid = slot_alloc();
+                if( m->uid == -1 ) full ++;
+            }
+            cur[ m->key ] = m->uid;
+        }else{
+            m->uid = it->second;
+        }
+    }
+
+    // it may still write these until it processes the del
+    for(map<string, int>::iterator it=prev.begin(); it != prev.end(); it++){
+        if( cur.find(it->first) == cur.end() ) slotquar.push_back( it->second );
+    }
+
+    monlock.unlock();
+
+    if( full ) PROBLEM("too many probes, %d not monitored", full);
+    DEBUG("%d probes, %d carried over, %d slots, %d not yet free", nw->size(), kept,
+          nslots - slotfree.size(), slotquar.size());
+}
+
+// consistent copy of a probe's slot. (nearly: if the writer
+// is stuck or dead mid update, settle for what is there)
+bool
+mon_probe_info(const Monitor *m, ProbeSlot *r){
+
+    if( m->uid < 0 ) return 0;
+    const ProbeSlot *sl = mon_slots + m->uid;
+
+    for(int n=0; n<MAXSPIN; n++){
+        uint32_t q = sl->seq;
+        MEMBAR();
+        r->status  = sl->status;
+        r->latency = sl->latency;
+        r->fails   = sl->fails;
+        r->t_check = sl->t_check;
+        r->checks  = sl->checks;
+        MEMBAR();
+        if( !(q & 1) && q == sl->seq ) break;
+    }
+
+    return 1;
+}
+
+// the mon process died. if it was in the middle of an update, finish it
+static void
+slot_repair(void){
+
+    for(int i=0; i<nslots; i++){
+        ProbeSlot *sl = mon_slots + i;
+        if( sl->seq & 1 ) sl->seq ++;
+    }
+}
+
+static void
+probe_set(map<int, string> *s){
+
+    s->clear();
+    for(int i=0; i<(int)zdb->monitored.size(); i++){
+        const Monitor *m = zdb->monitored[i]->probe;
+        if( m->uid >= 0 ) (*s)[ m->uid ] = m->key;
+    }
+}
+
+// held while zdb is replaced, so mon_start sees the
+// same zdb from the fork until it notes what the child runs
+void
+mon_lock(void){
+    monlock.lock();
+}
+
+void
+mon_unlock(void){
+    monlock.unlock();
+}
+
+// after a reload: send the mon process the changes, instead of restarting it
+void
+mon_reload(void){
+    map<int, string> want;
+    string cmds;
+
+    probe_set( &want );
+
+    monlock.lock();
+
+    if( monfd == -1 ){
+        // not running (yet). it will start with the current zdb
+        restart_requested = 1;
+        monlock.unlock();
+        return;
+    }
+
+    for(map<int, string>::iterator it=probing.begin(); it != probing.end(); it++){
+        if( want.find(it->first) != want.end() ) continue;
+        char buf[32];
+        snprintf(buf, sizeof(buf), "del %d\n", it->first);
+        cmds.append(buf);
+    }
+    for(map<int, string>::iterator it=want.begin(); it != want.end(); it++){
+        if( probing.find(it->first) != probing.end() ) continue;
+        char buf[32];
+        snprintf(buf, sizeof(buf), "add\t%d\t", it->first);
+        cmds.append(buf);
+        cmds.append(it->second);
+        cmds.append("\n");
+    }
+
+    probing.swap( want );
+
+    // it reads once a second. a big change may block us for a bit
+    const char *p = cmds.data();
+    int len = cmds.length();
+    while( len > 0 ){
+        int w = write(monfd, p, len);
+        if( w == -1 && errno == EINTR ) continue;
+        if( w < 1 ){
+            // it died? mon_manage will restart it
+            VERBOSE("cannot update mon process: %s", strerror(errno));
+            break;
+        }
+        p += w; len -= w;
+    }
+
+    monlock.unlock();
+    DEBUG("mon update %d bytes", cmds.length());
+}
+
 void
 mon_init(void){
     start_thread(mon_manage, 0);
@@ -76,54 +314,53 @@ mon_problem(const char *m, int e){
     sleep(10);
 }
 
-static void*
-mon_console(void *fd){
-    console_run(fd);
-    close( (int)(long)fd );
-    DEBUG("thread finished");
-}
-
 static void
 mon_start(void){
-    int pfd[2];
+    int cfd[2];
 
-    // connect pipe from mon process to console
-    // mon process will send status updates to its stdout
+    // mon process reads probe changes from its stdin
+    // and puts results in mon_slots
 
-    int pe = pipe(pfd);
+    int pe = pipe(cfd);
     if( pe == -1 ){
         mon_problem("cannot create pipe: %s", errno);
         return;
     }
 
+    // no reload between the fork + noting what it is running
+    monlock.lock();
+
     int pid = fork();
 
     if( pid == -1 ){
         // uh oh!
+        monlock.unlock();
+        close(cfd[0]); close(cfd[1]);
         mon_problem("cannot fork: %s", errno);
         return;
     }
     if( pid == 0 ){
         // child
-        // cnnect stdout to pipe
-        int de = dup2(pfd[1], 1);
+        // connect stdin to pipe
+        int de = dup2(cfd[0], 0);
         if( de == -1 ){
             PROBLEM("cannot dup2: %s", strerror(errno));
             exit(-1);
         }
-        close(pfd[0]);
-        close(pfd[1]);
+        close(cfd[0]);
+        close(cfd[1]);
         mon_run();
         exit(0);
     }
 
     // parent
     monpid = pid;
+    monfd  = cfd[1];
+    probe_set( &probing );
+    monlock.unlock();
     DEBUG("started mon proc pid %d", pid);
 
-    // connect pipe to console
-    close(pfd[1]);
-    start_thread( mon_console, (void*)(long)pfd[0] );
+    close(cfd[0]);
 }
 
 // run as thread in main process. start/restart child process to do monitoring
@@ -150,6 +387,11 @@ mon_manage(void* x){
                 DEBUG("mon proc exited %d", status);
                 if( status )
                     VERBOSE("mon process exited abnormally");
+                monlock.lock();
+                close(monfd);
+                monfd  = -1;
+                slot_repair();
+                monlock.unlock();
                 monpid = 0;
                 kills  = 0;
                 restart_requested = 1;
@@ -16,7 +16,9 @@
 #include "hrtime.h"
 #include "network.h"
 #include "runmode.h"
+#include "console.h"
 #include "dns.h"
+#include "epoch.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -26,14 +28,38 @@
 #include <signal.h>
 #include <setjmp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/resource.h>
+#include <fcntl.h>
+#include <map>
+#ifdef __linux__
+#  include <sys/epoll.h>
+#  define HAVE_EPOLL
+#endif
+#ifdef __sun__
+#  include <sys/processor.h>
+#  include <sys/procset.h>
+#endif
 
 #define TIMEOUT		10
 #define READ_TIMEOUT	15
 #define ALPHA		0.75
+#define MAXBATCH	256
+
+// recvmmsg + sendmmsg
+#ifdef MSG_WAITFORONE
+#  define HAVE_MMSG
+#endif
+
+// room for the SO_RXQ_OVFL drop counter
+#define CTLSIZE		64
+
+#define MAXEVENTS	64
+#define TCPREADSIZE	16384
+#define TCPMAXWRITE	65536	// stop answering while this much output is queued
 
 
 extern void install_handler(int, void(*)(int));
@@ -49,8 +75,15 @@ public:
     jmp_buf   jmp_abort;
     DNS_Stats stats;
     bool      tcpreading;
+    bool      is_tcp;
+    int       family;
+    int       udpfd;
+    int       tcpfd;
+    const char *cpus;
+    Epoch_Slot *epoch;
 
-    Thread_Stats(){ busy = 0; util = 0; timeout = 0; pid = 0; time_update = 0; tcpreading = 0; }
+    Thread_Stats(){ busy = 0; util = 0; timeout = 0; pid = 0; time_update = 0; tcpreading = 0;
+        is_tcp = 0; family = 0; udpfd = 0; tcpfd = 0; cpus = 0; epoch = 0; }
 
 };
 static Thread_Stats *thread_stat;
@@ -67,6 +100,7 @@ long net_timeouts   = 0;
 time_t last_timeout = 0;
 
 int net_udp, net_tcp;
+int net_udp6, net_tcp6;
 Mutex nthreadmtx;
 int nthreadcf;			// number configured
 int nthread       = 0;		// number running
@@ -176,6 +210,92 @@ calc_util(int thno, hrtime_t t0, hrtime_t t1, hrtime_t t2){
     DEBUG("request took %lld ns", (t2 - t1));
 }
 
+#ifdef __linux__
+// "0-3,8,10-11"
+static int
+parse_cpulist(const char *s, cpu_set_t *cs){
+    int n = 0;
+
+    while( *s ){
+        char *e;
+        int a = strtol(s, &e, 10);
+        if( e == s ) break;
+        int b = a;
+        s = e;
+        if( *s == '-' ){
+            b = strtol(s + 1, &e, 10);
+            s = e;
+        }
+        for( ; a<=b && a<CPU_SETSIZE; a++, n++) CPU_SET(a, cs);
+        if( *s == ',' ) s ++;
+    }
+
+    return n;
+}
+#endif
+
+// pin current thread to a cpu, or to a numa node's cpus
+static void
+pin_thread(const char *spec){
+
+    DEBUG("pinning thread to %s", spec);
+
+#if defined(__linux__)
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+
+    if( !strncmp(spec, "node", 4) ){
+        char file[128], buf[1024];
+        snprintf(file, sizeof(file), "/sys/devices/system/node/node%d/cpulist", atoi(spec + 4));
+        FILE *f = fopen(file, "r");
+        if( !f ){
+            PROBLEM("cannot pin thread to %s: %s", spec, strerror(errno));
+            return;
+        }
+        if( !fgets(buf, sizeof(buf), f) ) buf[0] = 0;
+        fclose(f);
+        if( !parse_cpulist(buf, &cs) ){
+            PROBLEM("cannot pin thread to %s: no cpus", spec);
+            return;
+        }
+    }else{
+        CPU_SET( atoi(spec), &cs );
+    }
+
+    int e = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+    if( e ) PROBLEM("cannot pin thread to %s: %s", spec, strerror(e));
+
+#elif defined(__sun__)
+    if( !strncmp(spec, "node", 4) ){
+        VERBOSE("cannot pin thread to %s: numa nodes not supported", spec);
+        return;
+    }
+    if( processor_bind(P_LWPID, P_MYID, atoi(spec), 0) == -1 )
+        PROBLEM("cannot pin thread to %s: %s", spec, strerror(errno));
+#else
+    VERBOSE("cpu pinning not supported on this platform");
+#endif
+}
+
+// socket receive queue drops (SO_RXQ_OVFL)
+static void
+rxq_drops(Thread_Stats *mystat, msghdr *m){
+#ifdef SO_RXQ_OVFL
+    if( !m->msg_controllen ) return;
+
+    for(cmsghdr *c = CMSG_FIRSTHDR(m); c; c = CMSG_NXTHDR(m, c)){
+        if( c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL ){
+            uint32_t d;
+            memcpy(&d, CMSG_DATA(c), sizeof(d));
+            // NB: kernel provides a running total
+            mystat->stats.n_udp_rxq_drop = d;
+        }
+    }
+#endif
+}
+
+// blocking tcp, without epoll
+#ifndef HAVE_EPOLL
 static int
 network_read_tcp(NTD * ntd){
     int i;
@@ -217,12 +337,12 @@ network_read_tcp(NTD * ntd){
 static void *
 network_accept_tcp(void *xthno){
     NTD *ntd;
-    struct sockaddr_in sa;
-    socklen_t l = sizeof(sa);
-    int fd = net_tcp;
+    struct sockaddr_storage sa;
+    socklen_t l;
     int thno = (long)xthno, nfd, i;
     hrtime_t t0=0, t1=0, t2=hr_now();
     Thread_Stats *mystat = thread_stat + thno;
+    int fd = mystat->tcpfd;
     iovec iov[2];
 
     // pre allocate things
@@ -234,12 +354,14 @@ network_accept_tcp(void *xthno){
     nthread++;
     nthreadmtx.unlock();
     mystat->pid = pthread_self();
+    mystat->epoch = epoch_register();
 
     while(1){
 	if( runmode.mode() == RUN_MODE_EXITING ) break;
         mystat->busy    = 0;
         mystat->timeout = 0;
         t0 = t2;
+        l  = sizeof(sa);
 	nfd = accept(fd, (sockaddr *)&sa, &l);
         t1 = hr_now();
         ntd->fd = nfd;
@@ -272,7 +394,9 @@ network_accept_tcp(void *xthno){
                 if( config->trace_is_set('N') )
                     hexdump("tcp recv", ntd->querb.buf, ntd->querb.datalen);
 
+                epoch_enter(mystat->epoch);
                 int rl = dns_process(ntd);
+                epoch_leave(mystat->epoch);
                 DEBUG("response %d", rl);
                 if( config->trace_is_set('N') )
                     hexdump("tcp send", ntd->respb.buf, rl);
@@ -288,6 +412,7 @@ network_accept_tcp(void *xthno){
         }else{
             // got a timeout | segv
             VERBOSE("aborted processing request");
+            epoch_leave(mystat->epoch);
         }
 
         mystat->timeout    = 0;
@@ -298,6 +423,7 @@ network_accept_tcp(void *xthno){
     }
 
     // unallocate things
+    epoch_unregister(mystat->epoch);
     delete ntd;
 
     nthreadmtx.lock();
@@ -306,35 +432,465 @@ network_accept_tcp(void *xthno){
 
     return 0;
 }
+#endif
+
+#ifdef HAVE_EPOLL
+// event driven tcp. each thread multiplexes many connections,
+// multiple (pipelined) requests per connection (rfc 7766)
+
+class TCP_Conn {
+public:
+    int		fd;
+    bool	wantout;	// waiting for output to drain
+    bool	counted;	// against the per client limit
+    time_t	last;		// last activity, for idle timeout
+    int		nquery;
+    sockaddr_storage sa;
+    socklen_t	salen;
+    string	rbuf;		// partial requests
+    string	wbuf;		// pending responses
+    TCP_Conn	*prev, *next;
+
+    TCP_Conn(){ fd = -1; wantout = 0; counted = 0; last = 0; nquery = 0; salen = 0; prev = next = this; }
+};
+
+static Mutex tcpclientmtx;
+static std::map<string,int> tcpclients;
+
+static string
+tcp_client_key(const sockaddr_storage *sa){
+
+    if( sa->ss_family == AF_INET6 )
+        return string( (const char*)& ((const sockaddr_in6*)sa)->sin6_addr, 16 );
+
+    return string( (const char*)& ((const sockaddr_in*)sa)->sin_addr, 4 );
+}
+
+// enforce per client connection limit
+static bool
+tcp_client_add(const sockaddr_storage *sa){
+    int max = config->tcp_maxperclient;
+
+    if( max <= 0 ) return 0;
+
+    string k = tcp_client_key(sa);
+    bool ok  = 1;
+
+    tcpclientmtx.lock();
+    int &n = tcpclients[k];
+    if( n >= max )
+        ok = 0;
+    else
+        n ++;
+    tcpclientmtx.unlock();
+
+    return ok;
+}
+
+static void
+tcp_client_del(const sockaddr_storage *sa){
+    string k = tcp_client_key(sa);
+
+    tcpclientmtx.lock();
+    std::map<string,int>::iterator it = tcpclients.find(k);
+    if( it != tcpclients.end() && --it->second <= 0 ) tcpclients.erase(it);
+    tcpclientmtx.unlock();
+}
+
+static void
+tcp_close(Thread_Stats *mystat, TCP_Conn *c){
+
+    DEBUG("closing connection %d, %d queries", c->fd, c->nquery);
+
+    // queries per connection: 0, 1, 2-3, 4-7, ... 64+
+    int b = 0;
+    for(int n=c->nquery; n && b<7; n >>= 1) b ++;
+    mystat->stats.n_tcp_qpc[b] ++;
+
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+
+    close(c->fd);	// also removes it from epoll
+    if( c->counted ) tcp_client_del(&c->sa);
+    mystat->stats.n_tcp_open --;
+    delete c;
+}
+
+static void
+tcp_want_output(int efd, TCP_Conn *c, bool out){
+    epoll_event ev;
+
+    if( c->wantout == out ) return;
+
+    ev.events   = out ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->wantout  = out;
+}
+
+static void
+tcp_accept(Thread_Stats *mystat, int efd, int fd, TCP_Conn *conns){
+    epoll_event ev;
+    sockaddr_storage sa;
+    socklen_t l;
+    int i;
+
+    // take everything waiting
+    for(int n=0; n<MAXEVENTS; n++){
+        l = sizeof(sa);
+        int nfd = accept4(fd, (sockaddr *)&sa, &l, SOCK_NONBLOCK);
+
+        if( nfd == -1 ){
+            if( errno != EAGAIN && errno != EWOULDBLOCK ) DEBUG("accept failed");
+            return;
+        }
+
+        mystat->stats.n_tcp ++;
+
+        bool counted = 0;
+        if( config->tcp_maxperclient > 0 ){
+            if( !tcp_client_add(&sa) ){
+                DEBUG("too many connections from client");
+                mystat->stats.n_tcp_refused ++;
+                close(nfd);
+                continue;
+            }
+            counted = 1;
+        }
+
+        // disable nagle
+        i = 1;
+        setsockopt(nfd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+
+        TCP_Conn *c = new TCP_Conn;
+        c->fd      = nfd;
+        c->counted = counted;
+        c->last    = lr_now();
+        c->salen   = l;
+        memcpy(&c->sa, &sa, l);
+
+        ev.events   = EPOLLIN;
+        ev.data.ptr = c;
+        if( epoll_ctl(efd, EPOLL_CTL_ADD, nfd, &ev) == -1 ){
+            PROBLEM("epoll_ctl failed: %s", strerror(errno));
+            close(nfd);
+            if( counted ) tcp_client_del(&sa);
+            delete c;
+            continue;
+        }
+
+        c->next = conns->next;
+        c->prev = conns;
+        conns->next->prev = c;
+        conns->next = c;
+        mystat->stats.n_tcp_open ++;
+
+        DEBUG("new connection %d", nfd);
+    }
+}
+
+// returns: -1 error, 0 all sent, 1 more pending
+static int
+tcp_flush(TCP_Conn *c){
+
+    while( !c->wbuf.empty() ){
+        int i = write(c->fd, c->wbuf.data(), c->wbuf.size());
+        if( i < 0 ){
+            if( errno == EINTR ) continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK ) return 1;
+            DEBUG("write error");
+            return -1;
+        }
+        c->wbuf.erase(0, i);
+    }
+
+    return 0;
+}
+
+// returns length of response, or -1 if aborted
+static int
+tcp_query(Thread_Stats *mystat, NTD *ntd){
+    int rl;
+
+    if( setjmp( mystat->jmp_abort ) ){
+        // got a timeout | segv
+        VERBOSE("aborted processing request");
+        epoch_leave(mystat->epoch);
+        mystat->timeout = 0;
+        return -1;
+    }
+
+    mystat->timeout = lr_now() + TIMEOUT;
+
+    if( config->trace_is_set('N') )
+        hexdump("tcp recv", ntd->querb.buf, ntd->querb.datalen);
+
+    epoch_enter(mystat->epoch);
+    rl = dns_process(ntd);
+    epoch_leave(mystat->epoch);
+    DEBUG("response %d", rl);
+
+    if( config->trace_is_set('N') )
+        hexdump("tcp send", ntd->respb.buf, rl);
+
+    mystat->timeout = 0;
+    return rl;
+}
+
+// answer complete requests, until output backs up
+// returns 1 if there are more to answer
+static bool
+tcp_answer(Thread_Stats *mystat, NTD *ntd, TCP_Conn *c, const uchar *p, int len, int *ppos){
+    int pos = *ppos;
+
+    while( len - pos >= 2 ){
+        int plen = (p[pos] << 8) | p[pos + 1];
+
+        if( !plen ) break;
+        if( len - pos - 2 < plen ) break;
+        if( c->wbuf.size() >= TCPMAXWRITE ){
+            *ppos = pos;
+            return 1;
+        }
+
+        ntd->reset(MAXTCP);
+        memcpy(ntd->querb.buf, p + pos + 2, plen);
+        ntd->querb.datalen = plen;
+        ntd->fd    = c->fd;
+        ntd->sa    = (sockaddr*)&c->sa;
+        ntd->salen = c->salen;
+        pos += plen + 2;
+
+        mystat->stats.n_tcp_queries ++;
+        c->nquery ++;
+
+        int rl = tcp_query(mystat, ntd);
+        if( rl < 0 ){
+            *ppos = -1;
+            return 0;
+        }
+
+        if( rl ){
+            uchar tl[2];
+            tl[0] = rl >> 8;
+            tl[1] = rl & 0xFF;
+            c->wbuf.append((char*)tl, 2);
+            c->wbuf.append((char*)ntd->respb.buf, rl);
+        }
+    }
+
+    // zero length request is bogus
+    if( len - pos >= 2 && !p[pos] && !p[pos+1] ) pos = -1;
+
+    *ppos = pos;
+    return 0;
+}
+
+// answer all complete requests that have arrived, send responses
+// returns 0 if the connection should be closed
+static int
+tcp_run(Thread_Stats *mystat, NTD *ntd, int efd, TCP_Conn *c){
+    const uchar *p = (const uchar *)c->rbuf.data();
+    int len = c->rbuf.size();
+    int pos = 0;
+    int w;
+
+    while(1){
+        bool more = tcp_answer(mystat, ntd, c, p, len, &pos);
+        if( pos < 0 ) return 0;
+
+        w = tcp_flush(c);
+        if( w < 0 ) return 0;
+        // stop if the client is not reading its responses
+        if( w || !more ) break;
+    }
+
+    if( pos ) c->rbuf.erase(0, pos);
+
+    tcp_want_output(efd, c, w);
+    return 1;
+}
+
+// returns 0 if the connection should be closed
+static int
+tcp_read(Thread_Stats *mystat, NTD *ntd, int efd, TCP_Conn *c, char *buf){
+
+    int i = read(c->fd, buf, TCPREADSIZE);
+    DEBUG("read %d", i);
+
+    if( !i ) return 0; // eof
+    if( i < 0 ){
+        if( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) return 1;
+        DEBUG("read error");
+        return 0;
+    }
+
+    c->last = lr_now();
+    c->rbuf.append(buf, i);
+
+    return tcp_run(mystat, ntd, efd, c);
+}
+
+// returns 0 if the connection should be closed
+static int
+tcp_write(Thread_Stats *mystat, NTD *ntd, int efd, TCP_Conn *c){
+
+    int w = tcp_flush(c);
+    if( w < 0 ) return 0;
+    if( w ) return 1;
+
+    c->last = lr_now();
+    // process anything that was held back
+    return tcp_run(mystat, ntd, efd, c);
+}
+
+static void
+tcp_close_idle(Thread_Stats *mystat, TCP_Conn *conns, time_t nowt){
+    time_t idle = config->tcp_idle;
+
+    if( idle <= 0 ) return;
+
+    for(TCP_Conn *c=conns->next; c!=conns; ){
+        TCP_Conn *n = c->next;
+        if( c->last + idle < nowt ){
+            mystat->stats.n_tcp_idle ++;
+            tcp_close(mystat, c);
+        }
+        c = n;
+    }
+}
+
+static void *
+network_events_tcp(void *xthno){
+    NTD *ntd;
+    int thno = (long)xthno, n, i;
+    hrtime_t t0=0, t1=0, t2=hr_now();
+    Thread_Stats *mystat = thread_stat + thno;
+    int fd = mystat->tcpfd;
+    epoll_event ev[MAXEVENTS];
+    TCP_Conn conns;		// list head
+    time_t lastsweep = 0;
+
+    // pre allocate things
+    ntd = new NTD (TCPBUFSIZ);
+    ntd->thno  = thno;
+    ntd->stats = & mystat->stats;
+    char *buf  = new char [TCPREADSIZE];
+
+    int efd = epoll_create(MAXEVENTS);
+    if( efd == -1 ){
+        FATAL("cannot create epoll: %s", strerror(errno));
+    }
+
+    // listening socket is shared by all tcp threads
+    ev[0].data.ptr = 0;
+    ev[0].events   = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    ev[0].events  |= EPOLLEXCLUSIVE;
+#endif
+    if( epoll_ctl(efd, EPOLL_CTL_ADD, fd, ev) == -1 ){
+        FATAL("epoll_ctl failed: %s", strerror(errno));
+    }
+
+    nthreadmtx.lock();
+    nthread++;
+    nthreadmtx.unlock();
+    mystat->pid = pthread_self();
+    mystat->epoch = epoch_register();
+
+    while(1){
+	if( runmode.mode() == RUN_MODE_EXITING ) break;
+        mystat->busy    = 0;
+        mystat->timeout = 0;
+        t0 = t2;
+        n  = epoll_wait(efd, ev, MAXEVENTS, 1000);
+        t1 = hr_now();
+        mystat->busy = (n > 0);
+
+        for(i=0; i<n; i++){
+            TCP_Conn *c = (TCP_Conn*)ev[i].data.ptr;
+
+            if( !c ){
+                tcp_accept(mystat, efd, fd, &conns);
+                continue;
+            }
+
+            int ok;
+            if( c->wantout )
+                ok = tcp_write(mystat, ntd, efd, c);
+            else
+                ok = tcp_read(mystat, ntd, efd, c, buf);
+
+            if( !ok ) tcp_close(mystat, c);
+        }
+
+        time_t nowt = lr_now();
+        if( nowt != lastsweep ){
+            tcp_close_idle(mystat, &conns, nowt);
+            lastsweep = nowt;
+        }
+
+        t2 = hr_now();
+        calc_util(thno, t0, t1, t2);
+    }
+
+    // unallocate things
+    epoch_unregister(mystat->epoch);
+    while( conns.next != &conns ) tcp_close(mystat, conns.next);
+    close(efd);
+    delete [] buf;
+    delete ntd;
+
+    nthreadmtx.lock();
+    nthread--;
+    nthreadmtx.unlock();
+
+    return 0;
+}
+#endif
 
 
 static void *
 network_accept_udp(void *xthno){
     NTD *ntd;
-    struct sockaddr_in sa;
-    socklen_t l = sizeof(sa);
-    int fd = net_udp;
-    int thno = (long)xthno, nfd, i;
+    struct sockaddr_storage sa;
+    int thno = (long)xthno, i;
     hrtime_t t0=0, t1=0, t2=hr_now();
     Thread_Stats *mystat = thread_stat + thno;
+    int fd = mystat->udpfd;
+    char ctl[CTLSIZE];
+    msghdr msg;
+    iovec iov;
 
     // pre allocate things
     ntd = new NTD (UDPBUFSIZ);
     ntd->thno  = thno;
-    ntd->fd    = net_udp;
+    ntd->fd    = fd;
     ntd->stats = & mystat->stats;
 
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base    = ntd->querb.buf;
+    iov.iov_len     = UDPBUFSIZ;
+    msg.msg_name    = &sa;
+    msg.msg_iov     = &iov;
+    msg.msg_iovlen  = 1;
+    msg.msg_control = ctl;
+
     nthreadmtx.lock();
     nthread++;
     nthreadmtx.unlock();
     mystat->pid = pthread_self();
+    mystat->epoch = epoch_register();
+    if( mystat->cpus ) pin_thread( mystat->cpus );
 
     while(1){
 	if( runmode.mode() == RUN_MODE_EXITING ) break;
         mystat->busy    = 0;
         mystat->timeout = 0;
         t0 = t2;
-        i = recvfrom(fd, ntd->querb.buf, UDPBUFSIZ, 0, (sockaddr*)&sa, &l);
+        msg.msg_namelen    = sizeof(sa);
+        msg.msg_controllen = sizeof(ctl);
+        i = recvmsg(fd, &msg, 0);
         t1 = hr_now();
 
         if( !i ) continue;
@@ -343,10 +899,12 @@ network_accept_udp(void *xthno){
 	    continue;
 	}
 
+        rxq_drops(mystat, &msg);
+
         ntd->reset(MAXUDP);
         ntd->querb.datalen = i;
         ntd->sa    = (sockaddr*)&sa;
-        ntd->salen = l;
+        ntd->salen = msg.msg_namelen;
         mystat->busy = 1;
 
 	DEBUG("new udp request %d, l=%d", thno, i);
@@ -358,14 +916,17 @@ network_accept_udp(void *xthno){
 
             mystat->timeout = lr_now() + TIMEOUT;
 
+            epoch_enter(mystat->epoch);
             int rl = dns_process(ntd);
-            if( rl ) sendto(fd, ntd->respb.buf, rl, 0, (sockaddr*)&sa, sizeof(sa));
+            epoch_leave(mystat->epoch);
+            if( rl ) sendto(fd, ntd->respb.buf, rl, 0, (sockaddr*)&sa, msg.msg_namelen);
 
             if( config->trace_is_set('N') )
                 hexdump("udp send", ntd->respb.buf, rl);
         }else{
             // got a timeout | segv
             VERBOSE("aborted processing request");
+            epoch_leave(mystat->epoch);
         }
 
         mystat->timeout = 0;
@@ -374,6 +935,7 @@ network_accept_udp(void *xthno){
     }
 
     // unallocate things
+    epoch_unregister(mystat->epoch);
     delete ntd;
 
     nthreadmtx.lock();
@@ -384,55 +946,315 @@ network_accept_udp(void *xthno){
 }
 
 
-void
-network_init(void){
-    struct sockaddr_in sa;
-    struct hostent *he;
-    int udp, tcp, i;
+#ifdef HAVE_MMSG
+// receive a batch of requests, process them, send all the responses
+static void *
+network_accept_udp_batch(void *xthno){
+    int thno = (long)xthno, n, i;
+    int nbatch = BOUND(config->udp_batch, 1, MAXBATCH);
+    hrtime_t t0=0, t1=0, t2=hr_now();
+    Thread_Stats *mystat = thread_stat + thno;
+    int fd = mystat->udpfd;
 
-    nthreadcf = config->udp_threads + config->tcp_threads;
-    if(!nthreadcf){
-	FATAL("no threads configured");
+    // pre allocate things
+    NTD         **ntd  = new NTD* [nbatch];
+    sockaddr_storage *sa = new sockaddr_storage [nbatch];
+    mmsghdr     *rmsg  = new mmsghdr [nbatch];
+    mmsghdr     *smsg  = new mmsghdr [nbatch];
+    iovec       *riov  = new iovec [nbatch];
+    iovec       *siov  = new iovec [nbatch];
+    char        *ctl   = new char [nbatch * CTLSIZE];
+
+    memset(rmsg, 0, nbatch * sizeof(mmsghdr));
+    memset(smsg, 0, nbatch * sizeof(mmsghdr));
+
+    for(i=0; i<nbatch; i++){
+        ntd[i] = new NTD (UDPBUFSIZ);
+        ntd[i]->thno  = thno;
+        ntd[i]->fd    = fd;
+        ntd[i]->stats = & mystat->stats;
+
+        riov[i].iov_base = ntd[i]->querb.buf;
+        riov[i].iov_len  = UDPBUFSIZ;
+        rmsg[i].msg_hdr.msg_name    = & sa[i];
+        rmsg[i].msg_hdr.msg_iov     = & riov[i];
+        rmsg[i].msg_hdr.msg_iovlen  = 1;
+        rmsg[i].msg_hdr.msg_control = ctl + i * CTLSIZE;
     }
-    thread_stat = new Thread_Stats[ nthreadcf ];
 
-    myport = config->port_dns;
-    if( !myport ){
-	FATAL("cannot determine port to use");
+    nthreadmtx.lock();
+    nthread++;
+    nthreadmtx.unlock();
+    mystat->pid = pthread_self();
+    mystat->epoch = epoch_register();
+    if( mystat->cpus ) pin_thread( mystat->cpus );
+
+    while(1){
+	if( runmode.mode() == RUN_MODE_EXITING ) break;
+        mystat->busy    = 0;
+        mystat->timeout = 0;
+        t0 = t2;
+
+        for(i=0; i<nbatch; i++){
+            rmsg[i].msg_hdr.msg_namelen    = sizeof(sockaddr_storage);
+            rmsg[i].msg_hdr.msg_controllen = CTLSIZE;
+        }
+
+        n = recvmmsg(fd, rmsg, nbatch, MSG_WAITFORONE, 0);
+        t1 = hr_now();
+
+        if( n < 1 ){
+	    DEBUG("recv failed");
+	    continue;
+	}
+
+        mystat->busy = 1;
+        mystat->stats.n_udp_batch ++;
+        mystat->stats.n_udp_batch_pkts += n;
+        rxq_drops(mystat, & rmsg[n-1].msg_hdr);
+        DEBUG("new udp batch %d, n=%d", thno, n);
+
+        // NB: may be modified between setjmp + longjmp
+        volatile int nsend = 0;
+        epoch_enter(mystat->epoch);
+
+        for(i=0; i<n; i++){
+            NTD *nt = ntd[i];
+            int l   = rmsg[i].msg_len;
+
+            if( !l ) continue;
+
+            nt->reset(MAXUDP);
+            nt->querb.datalen = l;
+            nt->sa    = (sockaddr*)&sa[i];
+            nt->salen = rmsg[i].msg_hdr.msg_namelen;
+
+            if( config->trace_is_set('N') )
+                hexdump("udp recv", nt->querb.buf, nt->querb.datalen);
+
+            if( ! setjmp( mystat->jmp_abort ) ){
+
+                mystat->timeout = lr_now() + TIMEOUT;
+
+                int rl = dns_process(nt);
+
+                if( rl ){
+                    int ns = nsend;
+                    siov[ns].iov_base = nt->respb.buf;
+                    siov[ns].iov_len  = rl;
+                    smsg[ns].msg_hdr.msg_name    = & sa[i];
+                    smsg[ns].msg_hdr.msg_namelen = rmsg[i].msg_hdr.msg_namelen;
+                    smsg[ns].msg_hdr.msg_iov     = & siov[ns];
+                    smsg[ns].msg_hdr.msg_iovlen  = 1;
+                    nsend = ns + 1;
+                }
+
+                if( config->trace_is_set('N') )
+                    hexdump("udp send", nt->respb.buf, rl);
+            }else{
+                // got a timeout | segv
+                VERBOSE("aborted processing request");
+            }
+
+            mystat->timeout = 0;
+        }
+        epoch_leave(mystat->epoch);
+
+        // send responses
+        for(i=0; i<nsend; ){
+            int s = sendmmsg(fd, smsg + i, nsend - i, 0);
+            if( s < 1 ){
+                if( s == -1 && errno == EINTR ) continue;
+                DEBUG("send failed");
+                break;
+            }
+            i += s;
+        }
+
+        t2 = hr_now();
+        calc_util(thno, t0, t1, t2);
     }
-    gethostname( hostname, sizeof(hostname));
 
+    // unallocate things
+    epoch_unregister(mystat->epoch);
+    for(i=0; i<nbatch; i++) delete ntd[i];
+    delete [] ntd;
+    delete [] sa;
+    delete [] rmsg;
+    delete [] smsg;
+    delete [] riov;
+    delete [] siov;
+    delete [] ctl;
 
-    // open sockets
-    tcp = socket(PF_INET, SOCK_STREAM, 6);
+    nthreadmtx.lock();
+    nthread--;
+    nthreadmtx.unlock();
+
+    return 0;
+}
+#endif
+
+
+// fill in sockaddr for family + configured address
+static int
+listen_addr(int family, const string *addr, sockaddr_storage *ss){
+    sockaddr_in  *si = (sockaddr_in*)ss;
+    sockaddr_in6 *s6 = (sockaddr_in6*)ss;
+
+    memset(ss, 0, sizeof(*ss));
+
+    if( family == AF_INET6 ){
+        s6->sin6_family = AF_INET6;
+        s6->sin6_port   = htons(myport);
+        if( inet_pton(AF_INET6, addr->c_str(), &s6->sin6_addr) != 1 ){
+            FATAL("invalid ipv6 listen address '%s'", addr->c_str());
+        }
+        return sizeof(sockaddr_in6);
+    }
+
+    si->sin_family = AF_INET;
+    si->sin_port   = htons(myport);
+    if( inet_pton(AF_INET, addr->c_str(), &si->sin_addr) != 1 ){
+        FATAL("invalid ipv4 listen address '%s'", addr->c_str());
+    }
+    return sizeof(sockaddr_in);
+}
+
+static void
+ipv6_only(int fd, int family){
+#ifdef IPV6_V6ONLY
+    // ipv4 has its own sockets
+    if( family == AF_INET6 ){
+        int i = 1;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &i, sizeof(i));
+    }
+#endif
+}
+
+static int
+tcp_socket(sockaddr_storage *sa, int salen){
+    int tcp, i;
+
+    tcp = socket(sa->ss_family, SOCK_STREAM, 6);
     if( tcp == -1 ){
 	FATAL("cannot create socket");
     }
 
-    sa.sin_family = AF_INET;
-    sa.sin_port   = htons(myport);
-    sa.sin_addr.s_addr = INADDR_ANY;
-
     i = 1;
     setsockopt(tcp, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+    ipv6_only(tcp, sa->ss_family);
 
-    i = bind(tcp, (sockaddr*)&sa, sizeof(sa));
+    i = bind(tcp, (sockaddr*)sa, salen);
     if( i == -1 ){
 	FATAL("cannot bind to port");
     }
+
+#ifdef HAVE_EPOLL
+    // threads multiplex connections, must not block in accept
+    fcntl(tcp, F_SETFL, fcntl(tcp, F_GETFL) | O_NONBLOCK);
+    listen(tcp, 128);
+#else
     listen(tcp, 10);
+#endif
+
+    return tcp;
+}
+
+static int
+udp_socket(sockaddr_storage *sa, int salen, bool reuse){
+    int udp, i;
 
-    udp = socket(PF_INET, SOCK_DGRAM, 17);
+    udp = socket(sa->ss_family, SOCK_DGRAM, 17);
     if( udp == -1 ){
 	FATAL("cannot create socket");
     }
-    i = bind(udp, (sockaddr*)&sa, sizeof(sa));
+
+    ipv6_only(udp, sa->ss_family);
+
+    if( reuse ){
+#ifdef SO_REUSEPORT
+        // let the kernel spread flows across per-thread sockets
+        i = 1;
+        if( setsockopt(udp, SOL_SOCKET, SO_REUSEPORT, &i, sizeof(i)) == -1 ){
+            FATAL("cannot set SO_REUSEPORT: %s", strerror(errno));
+        }
+#endif
+#ifdef SO_RXQ_OVFL
+        // count drops per socket
+        i = 1;
+        setsockopt(udp, SOL_SOCKET, SO_RXQ_OVFL, &i, sizeof(i));
+#endif
+    }
+
+    i = bind(udp, (sockaddr*)sa, salen);
     if( i == -1 ){
 	FATAL("cannot bind to port");
     }
 
-    net_tcp = tcp;
-    net_udp = udp;
+    return udp;
+}
+
+// open sockets for one address family, and set up its worker pool
+// returns the next thread number
+static int
+network_init_family(int family, const string *addr, int thno, bool reuse, int *udp, int *tcp){
+    struct sockaddr_storage sa;
+    int i;
+
+    int salen = listen_addr(family, addr, &sa);
+    *tcp = tcp_socket(&sa, salen);
+    *udp = udp_socket(&sa, salen, reuse);
+
+    // per thread sockets + cpus
+    int ncpus = config->udp_cpus.size();
+    for(i=0; i<config->udp_threads; i++, thno++){
+        Thread_Stats *ts = thread_stat + thno;
+        ts->family = family;
+        ts->udpfd  = (reuse && i) ? udp_socket(&sa, salen, reuse) : *udp;
+        if( ncpus ) ts->cpus = config->udp_cpus[ i % ncpus ].c_str();
+    }
+    for(i=0; i<config->tcp_threads; i++, thno++){
+        Thread_Stats *ts = thread_stat + thno;
+        ts->family = family;
+        ts->is_tcp = 1;
+        ts->tcpfd  = *tcp;
+    }
+
+    VERBOSE("listening on %s port %d", addr->c_str(), myport);
+
+    return thno;
+}
+
+void
+network_init(void){
+    int i;
+
+    // one pool of workers per address family
+    int nfam  = config->listen_ipv6.empty() ? 1 : 2;
+    nthreadcf = (config->udp_threads + config->tcp_threads) * nfam;
+    if(!nthreadcf){
+	FATAL("no threads configured");
+    }
+    thread_stat = new Thread_Stats[ nthreadcf ];
+
+    myport = config->port_dns;
+    if( !myport ){
+	FATAL("cannot determine port to use");
+    }
+    gethostname( hostname, sizeof(hostname));
+
+    bool reuse = config->udp_reuseport;
+#ifndef SO_REUSEPORT
+    if( reuse ){
+        VERBOSE("udp_reuseport not supported on this platform, ignoring");
+        reuse = 0;
+    }
+#endif
+
+    // open sockets
+    int nt = network_init_family(AF_INET, & config->listen_ipv4, 0, reuse, &net_udp, &net_tcp);
+    if( nfam > 1 )
+        network_init_family(AF_INET6, & config->listen_ipv6, nt, reuse, &net_udp6, &net_tcp6);
 
     // install handlers
     install_handler( SIGALRM, sigalarm );
@@ -444,11 +1266,28 @@ network_init(void){
     // start threads
     DEBUG("starting %d network threads", nthreadcf);
 
-    for(i=0; i<config->udp_threads; i++){
-	start_thread( network_accept_udp, (void*)(long)i );
+    void *(*udpfunc)(void*) = network_accept_udp;
+
+    if( config->udp_batch > 1 ){
+#ifdef HAVE_MMSG
+        DEBUG("udp batch size %d", config->udp_batch);
+        udpfunc = network_accept_udp_batch;
+#else
+        VERBOSE("udp_batch not supported on this platform, ignoring");
+#endif
     }
-    for( ;i<nthreadcf; i++){
-	start_thread( network_accept_tcp, (void*)(long)i );
+
+#ifdef HAVE_EPOLL
+    void *(*tcpfunc)(void*) = network_events_tcp;
+#else
+    void *(*tcpfunc)(void*) = network_accept_tcp;
+#endif
+
+    for(i=0; i<nthreadcf; i++){
+        if( thread_stat[i].is_tcp )
+            start_thread( tcpfunc, (void*)(long)i );
+        else
+            start_thread( udpfunc, (void*)(long)i );
     }
 }
 
@@ -491,6 +1330,34 @@ thread_stats(time_t nowt,  int *nbusy, int *nactive, float *tutil){
         int64_t *t = (int64_t*)&net_stats + j;
         ATOMIC_SETPTR(*t, tot);
     }
+
+    epoch_stats( &net_stats );
+}
+
+// per thread status, for the console
+void
+network_thread_report(Console *con){
+    char buf[128];
+
+    for(int i=0; i<nthread; i++){
+        Thread_Stats *ts = thread_stat + i;
+        int64_t nb = ts->stats.n_udp_batch;
+
+        if( ts->is_tcp )
+            snprintf(buf, sizeof(buf), "%3d tcp%c %s util %.4f reqs %lld conns %lld open %lld\n",
+                     i, (ts->family == AF_INET6) ? '6' : '4',
+                     ts->busy ? "busy" : "idle", ts->util,
+                     (long long)ts->stats.n_requests, (long long)ts->stats.n_tcp,
+                     (long long)ts->stats.n_tcp_open );
+        else
+            snprintf(buf, sizeof(buf), "%3d udp%c %s util %.4f reqs %lld batch %.2f drops %lld cpu %s\n",
+                     i, (ts->family == AF_INET6) ? '6' : '4',
+                     ts->busy ? "busy" : "idle", ts->util,
+                     (long long)ts->stats.n_requests,
+                     nb ? ts->stats.n_udp_batch_pkts / (float)nb : 0.0,
+                     (long long)ts->stats.n_udp_rxq_drop, ts->cpus ? ts->cpus : "-" );
+        con->output(buf);
+    }
 }
 
 static int
@@ -517,8 +1384,18 @@ runmode_check(){
             DEBUG("shutting network down");
             shutdown(net_tcp, SHUT_RDWR);
             close(net_tcp);
+            if( net_tcp6 ){
+                shutdown(net_tcp6, SHUT_RDWR);
+                close(net_tcp6);
+            }
+            for(int i=0; i<nthreadcf; i++){
+                int ufd = thread_stat[i].udpfd;
+                if( ufd && ufd != net_udp && ufd != net_udp6 ) close(ufd);
+            }
             close(net_udp);
+            if( net_udp6 ) close(net_udp6);
             net_tcp = net_udp = 0;
+            net_tcp6 = net_udp6 = 0;
         }
         // wait until they all finish
         if( ! nthread ){
@@ -0,0 +1,129 @@
+/*
+  Copyright (c) 2026
+  Author: agent <agent @ local>
+  Created: 2026-Oct-17 17:52 (EDT)
+  Function: cache of rendered responses
+*/
+#define CURRENT_SUBSYSTEM	'D'
+
+#include "defs.h"
+#include "misc.h"
+#include "diag.h"
+#include "network.h"
+#include "dns.h"
+#include "rcache.h"
+
+#include <sys/socket.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+
+RCache::RCache(int n){
+
+    uint32_t sz = 16;
+    while( sz < (uint32_t)n ) sz <<= 1;
+
+    slot = new Slot[ sz ];
+    mask = sz - 1;
+    memset(slot, 0, sz * sizeof(Slot));
+
+    DEBUG("response cache %d slots", sz);
+}
+
+RCache::~RCache(){
+    delete [] slot;
+}
+
+// the part of the key describing the response shape, or -1 if not cacheable
+// NB: only complete responses <= MAXUDP are cached, they are the same
+// whatever size the client allows
+int
+RCache::shape(const NTD *ntd){
+    int s = 0;
+
+    // client subnet is echoed back, don't cache
+    if( ntd->edns.optcode ) return -1;
+
+    if( ntd->edns.udpsize ) s |= RCACHE_F_EDNS;
+    if( ntd->edns.nsid )    s |= RCACHE_F_NSID;
+
+    return s;
+}
+
+RCache::Slot *
+RCache::find_slot(const NTD *ntd, int shape) const {
+    uint32_t h = ntd->querd.namehash ^ (ntd->querd.type * 0x9E3779B1U) ^ shape;
+
+    return slot + (h & mask);
+}
+
+// copy cached response into ntd, fix up id, rd, question
+// returns length, or 0 if not found
+int
+RCache::get(NTD *ntd, int shape) const {
+    const Slot *s = find_slot(ntd, shape);
+    int nl = ntd->querd.namelen;
+
+    uint32_t seq = s->seq;
+    if( seq & 1 ) return 0;
+    MEMBAR();
+
+    if( s->hash != ntd->querd.namehash || s->namelen != nl ) return 0;
+    if( s->type != ntd->querd.type || s->shape != shape ) return 0;
+    if( memcmp(s->name, ntd->querd.name, nl) ) return 0;
+
+    int len = s->datalen;
+    if( len < (int)(sizeof(DNS_Hdr) + ntd->querd.qdlen) || len > RCACHE_MAXLEN ) return 0;
+    memcpy(ntd->respb.buf, s->data, len);
+
+    MEMBAR();
+    if( s->seq != seq ){
+        // changed while copying
+        memset(ntd->respb.buf, 0, sizeof(DNS_Hdr));
+        return 0;
+    }
+
+    DNS_Hdr *qury = (DNS_Hdr*) ntd->querb.buf;
+    DNS_Hdr *resp = (DNS_Hdr*) ntd->respb.buf;
+
+    // 1035 4.1.1 - Recursion Desired - [...] and is copied into the response
+    int rd = ntohs(qury->flags) & FLAG_RD;
+    ntd->respd.flags = ntohs(resp->flags) | rd;
+    resp->id    = qury->id;
+    resp->flags = htons( ntd->respd.flags );
+
+    // question as asked (case may differ)
+    memcpy( ntd->respb.buf + sizeof(DNS_Hdr), ntd->querb.buf + sizeof(DNS_Hdr), ntd->querd.qdlen );
+
+    return ntd->respb.datalen = len;
+}
+
+void
+RCache::put(NTD *ntd, int shape){
+    Slot *s = find_slot(ntd, shape);
+    int len = ntd->respb.datalen;
+
+    if( len > RCACHE_MAXLEN ) return;
+    // something didn't fit. a client allowing more would get more
+    if( ntd->respd.trimmed || (ntd->respd.flags & FLAG_TC) ) return;
+
+    // someone else is writing it? skip
+    uint32_t seq = s->seq;
+    if( seq & 1 ) return;
+    if( !ATOMIC_CAS32(s->seq, seq, seq + 1) ) return;
+
+    s->hash    = ntd->querd.namehash;
+    s->type    = ntd->querd.type;
+    s->shape   = shape;
+    s->namelen = ntd->querd.namelen;
+    s->datalen = len;
+    memcpy(s->name, ntd->querd.name, s->namelen);
+    memcpy(s->data, ntd->respb.buf, len);
+
+    // rd comes from each query
+    DNS_Hdr *resp = (DNS_Hdr*) s->data;
+    resp->flags = htons( ntohs(resp->flags) & ~FLAG_RD );
+
+    MEMBAR();
+    s->seq = seq + 2;
+}
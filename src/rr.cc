@@ -24,24 +24,24 @@
 
 
 RR *
-RR::make(string *lab, int kl, int ty, int tt, bool wild){
+RR::make(Arena *a, string *lab, int kl, int ty, int tt, bool wild){
     RR *rr = 0;
 
     if( kl == CLASS_IN ){
         switch(ty){
-        case TYPE_A:	    rr = new RR_A; 		break;
-        case TYPE_AAAA:     rr = new RR_AAAA;		break;
-        case TYPE_NS:	    rr = new RR_NS;		break;
-        case TYPE_SOA: 	    rr = new RR_SOA;		break;
-        case TYPE_CNAME:    rr = new RR_CNAME;		break;
-        case TYPE_PTR: 	    rr = new RR_PTR;		break;
-        case TYPE_MX: 	    rr = new RR_MX;		break;
-        case TYPE_TXT:	    rr = new RR_TXT;		break;
-        case TYPE_ALIAS:    rr = new RR_Alias;		break;
-        case TYPE_GLB_RR:   rr = new RR_GLB_RR;		break;
-        case TYPE_GLB_GEO:  rr = new RR_GLB_Geo;	break;
-        case TYPE_GLB_MM:   rr = new RR_GLB_MM;		break;
-        case TYPE_GLB_Hash: rr = new RR_GLB_Hash;	break;
+        case TYPE_A:	    rr = new(a) RR_A; 		break;
+        case TYPE_AAAA:     rr = new(a) RR_AAAA;		break;
+        case TYPE_NS:	    rr = new(a) RR_NS;		break;
+        case TYPE_SOA: 	    rr = new(a) RR_SOA;		break;
+        case TYPE_CNAME:    rr = new(a) RR_CNAME;		break;
+        case TYPE_PTR: 	    rr = new(a) RR_PTR;		break;
+        case TYPE_MX: 	    rr = new(a) RR_MX;		break;
+        case TYPE_TXT:	    rr = new(a) RR_TXT;		break;
+        case TYPE_ALIAS:    rr = new(a) RR_Alias;		break;
+        case TYPE_GLB_RR:   rr = new(a) RR_GLB_RR;		break;
+        case TYPE_GLB_GEO:  rr = new(a) RR_GLB_Geo;	break;
+        case TYPE_GLB_MM:   rr = new(a) RR_GLB_MM;		break;
+        case TYPE_GLB_Hash: rr = new(a) RR_GLB_Hash;	break;
         default:
             BUG("cannot create RR type %d", ty);
             return 0;
@@ -49,7 +49,7 @@ RR::make(string *lab, int kl, int ty, int tt, bool wild){
     }
 
     if( kl == CLASS_CH && ty == TYPE_TXT )
-        rr = new RR_TXT;
+        rr = new(a) RR_TXT;
 
     if( ! rr ) return 0;
 
@@ -62,7 +62,7 @@ RR::make(string *lab, int kl, int ty, int tt, bool wild){
     rr->klass    = kl;
     rr->ttl      = tt;
     rr->wildcard = wild;
-    rr->set_name( lab );
+    rr->set_name( a, lab );
 
     return rr;
 }
@@ -91,30 +91,31 @@ cvt_name_to_wire(string *src, string *dst){
 }
 
 int
-RR::set_name(string *s){
+RR::set_name(Arena *a, string *s){
 
     if( s->empty() ){
-        name      = "@";
-        name_wire = "";
+        name.set(a, "@", 1);
         return 1;
     }
 
-    name = *s;
+    name.set(a, *s);
 
     if( wildcard ){
         // wire format will most likely just be a pointer to the question
         // handle later
-        name_wire = "";
         return 1;
     }
 
-    cvt_name_to_wire(s, &name_wire);
+    string w;
+    cvt_name_to_wire(s, &w);
+    name_wire.set(a, w);
 
     return 1;
 }
 
 void
-RRCompString::set_name(string dest, string *zonename){
+RRCompString::set_name(Arena *a, string dest, string *zonename){
+    string w;
 
     // relative or abs?
     // in zone?
@@ -122,9 +123,10 @@ RRCompString::set_name(string dest, string *zonename){
     if( dest[ dest.length() - 1 ] != '.' ){
         // relative name in zone
         same_zone = 1;
-        name      = dest;
-        fqdn      = dest + '.' + *zonename;
-        cvt_name_to_wire(&dest, &name_wire);
+        name.set(a, dest);
+        fqdn.set(a, dest + '.' + *zonename);
+        cvt_name_to_wire(&dest, &w);
+        name_wire.set(a, w);
         DEBUG("relative, same %s -> %s", name.c_str(), fqdn.c_str());
         return;
     }
@@ -133,14 +135,16 @@ RRCompString::set_name(string dest, string *zonename){
     if( zp == dest.length() - zonename->length() ){
         // absolute name in zone
         same_zone = 1;
-        fqdn      = dest;
+        fqdn.set(a, dest);
         if( zp > 0 ){
-            name      = dest.substr(0, zp-1);
-            cvt_name_to_wire(&name, &name_wire);
+            string n = dest.substr(0, zp-1);
+            name.set(a, n);
+            cvt_name_to_wire(&n, &w);
+            name_wire.set(a, w);
         }else{
             // x CNAME zone.
-            name      = "";
-            name_wire = "";
+            name      = AStr();
+            name_wire = AStr();
         }
         DEBUG("absol, same %d, %s -> %s", zp, name.c_str(), fqdn.c_str());
         return;
@@ -148,7 +152,7 @@ RRCompString::set_name(string dest, string *zonename){
 
     // absolute out of zone
     same_zone = 0;
-    fqdn      = dest;
+    fqdn.set(a, dest);
 
     // pick a good split point
     int len = dest.length();
@@ -166,13 +170,17 @@ RRCompString::set_name(string dest, string *zonename){
         pos ++;
     }
 
-    name      = dest.substr(0, pos);
-    cvt_name_to_wire(&name, &name_wire);
+    string n = dest.substr(0, pos);
+    name.set(a, n);
+    cvt_name_to_wire(&n, &w);
+    name_wire.set(a, w);
 
     DEBUG("pos %d, len %d", pos, len);
     if( pos != len ){
-        domain = dest.substr(pos+1);
-        cvt_name_to_wire(&domain, &dom_wire);
+        string d = dest.substr(pos+1);
+        domain.set(a, d);
+        cvt_name_to_wire(&d, &w);
+        dom_wire.set(a, w);
         // NB: trailing dot turns into terminating 0
     }
 
@@ -186,12 +194,19 @@ RRCompString::set_name(string dest, string *zonename){
 
 //################################################################
 
-void
-RR_Raw::config_raw(){
-    DNS_RR_Hdr *hdr = (DNS_RR_Hdr*) rrdata.data();
-    hdr->type  = htons( type );
-    hdr->klass = htons( klass );
-    hdr->ttl   = htonl( ttl );
+// space for the rr, in the zone's arena. fill in the header
+DNS_RR_Hdr *
+RR_Raw::config_raw(Zone *z, int rdlen){
+
+    rrlen  = DNS_RR_HDR_SIZE + rdlen;
+    rrdata = (char*)z->arena->alloc( rrlen );
+
+    DNS_RR_Hdr *hdr = (DNS_RR_Hdr*) rrdata;
+    hdr->type     = htons( type );
+    hdr->klass    = htons( klass );
+    hdr->ttl      = htonl( ttl );
+    hdr->rdlength = htons( rdlen );
+    return hdr;
 }
 
 int
@@ -211,11 +226,7 @@ RR_TXT::configure(InputF *f, Zone *z, string *rspec){
 
     if( txtlen + bks > 0xFFFF ) return 1;	// won't fit
 
-    rrdata.resize( DNS_RR_HDR_SIZE + txtlen + bks );
-    config_raw();
-
-    DNS_RR_Hdr *hdr = (DNS_RR_Hdr*) rrdata.data();
-    hdr->rdlength   = htons( txtlen + bks );
+    DNS_RR_Hdr *hdr = config_raw( z, txtlen + bks );
 
     uchar *dst = (uchar*) hdr->rdata;
     while( txtlen ){
@@ -234,11 +245,7 @@ RR_TXT::configure(InputF *f, Zone *z, string *rspec){
 int
 RR_A::configure(InputF *f, Zone *z, string *rspec){
 
-    rrdata.resize( DNS_RR_HDR_SIZE + 4 );
-    config_raw();
-
-    DNS_RR_Hdr *hdr = (DNS_RR_Hdr*) rrdata.data();
-    hdr->rdlength   = htons( 4 );
+    DNS_RR_Hdr *hdr = config_raw( z, 4 );
 
     int i = inet_pton(AF_INET, rspec->c_str(), hdr->rdata);
     if( i != 1 ){
@@ -252,11 +259,7 @@ RR_A::configure(InputF *f, Zone *z, string *rspec){
 int
 RR_AAAA::configure(InputF *f, Zone *z, string *rspec){
 
-    rrdata.resize( DNS_RR_HDR_SIZE + 16 );
-    config_raw();
-
-    DNS_RR_Hdr *hdr = (DNS_RR_Hdr*) rrdata.data();
-    hdr->rdlength   = htons( 16 );
+    DNS_RR_Hdr *hdr = config_raw( z, 16 );
 
     int i = inet_pton(AF_INET6, rspec->c_str(), hdr->rdata);
 
@@ -271,14 +274,14 @@ RR_AAAA::configure(InputF *f, Zone *z, string *rspec){
 int
 RR_Compress::configure(InputF *f, Zone *z, string *rspec){
 
-    rrdata.set_name( *rspec, & z->zonename );
+    rrdata.set_name( z->arena, *rspec, & z->zonename );
     return 0;
 }
 
 int
 RR_Alias::configure(InputF *f, Zone *z, string *rspec){
 
-    target.assign( *rspec );
+    target.set( z->arena, *rspec );
     DEBUG("alias => %s", rspec->c_str());
     return 0;
 }
@@ -288,6 +291,23 @@ RR_Alias::configure(InputF *f, Zone *z, string *rspec){
 int
 RRSet::add_answers(NTD *ntd, int qkl, int qty) const {
 
+    if( qkl == CLASS_IN && !answer.empty() ){
+        // pre-rendered
+        const WireImg *img = 0;
+        for(int i=0; i<answer.size(); i++){
+            if( answer[i].first == qty ) img = & answer[i].second;
+        }
+        // nothing of that type here
+        if( !img ) return 1;
+
+        if( img->put(ntd) ){
+            ntd->respd.ancount += img->count;
+            if( img->has_ns ) ntd->respd.has_ns_ans = 1;
+            return 1;
+        }
+        // too big, add what fits below
+    }
+
     for(int i=0; i<rr.size(); i++){
         RR *r = rr[i];
 
@@ -339,6 +359,11 @@ RR_Alias::add_answer(NTD *ntd, bool isq, int qkl, int qty) const{
     return 1;
 }
 
+bool
+RR_Alias::is_static() const {
+    return !targ_rrs || targ_rrs->is_static();
+}
+
 // add additional data as answers (for CNAME)
 int
 RR::add_add_ans(NTD *ntd, int qkl, int qty) const {
@@ -381,10 +406,16 @@ RRSet::add_additnl(NTD *ntd, int qkl, int qty) const {
 int
 Zone::add_ns_auth(NTD *ntd) const {
 
+    if( ns_auth.count && ns_auth.put(ntd) ){
+        ntd->respd.nscount += ns_auth.count;
+        return 1;
+    }
+
     for(int i=0; i<ns.size(); i++){
         RR *r = ns[i];
         if( r->put_rr(ntd, 0) ) ntd->respd.nscount ++;
     }
+    return 1;
 }
 
 int
@@ -397,6 +428,7 @@ Zone::add_ns_addl(NTD *ntd) const {
             if( ra->put_rr(ntd, 0) ) ntd->respd.arcount ++;
         }
     }
+    return 1;
 }
 
 int
@@ -416,10 +448,11 @@ RR::put_rr(NTD *ntd, bool isq) const {
 
     int save = ntd->respb.datalen;
 
-    if( put_name(ntd, isq) && _put_rr(ntd) ) return 1;
+    if( put_name(ntd, isq) && (wire.empty() ? _put_rr(ntd) : wire.put(ntd)) ) return 1;
 
     // no room, rewind
     ntd->respb.datalen = save;
+    ntd->respd.trimmed = 1;
     return 0;
 
 }
@@ -433,7 +466,7 @@ RR::put_name(NTD *ntd, bool isq) const {
         // NB: results are always in the question's zone
         // label + zone-ptr
 
-        ntd->respb.put_data((uchar*) name_wire.c_str(), name_wire.length());
+        ntd->respb.put_data((uchar*) name_wire.data(), name_wire.length());
         ntd->respb.put_short( 0xC000 + ntd->ztab.zpos );
     }
 
@@ -445,8 +478,8 @@ RR::put_name(NTD *ntd, bool isq) const {
 int
 RR_Raw::_put_rr(NTD *ntd) const {
 
-    if( ! ntd->space_avail(rrdata.length()) ) return 0;
-    ntd->respb.put_data((uchar*) rrdata.c_str(), rrdata.length());
+    if( ! ntd->space_avail(rrlen) ) return 0;
+    ntd->respb.put_data((uchar*) rrdata, rrlen);
     return ntd->space_avail(0);
 }
 
@@ -498,6 +531,103 @@ RR_SOA::_put_rr(NTD *ntd) const {
 
 //################################################################
 
+void
+WireBuf::put_short(int v){
+    data += (char)(v >> 8);
+    data += (char)(v & 0xFF);
+}
+
+void
+WireBuf::put_long(uint32_t v){
+    put_short( v >> 16 );
+    put_short( v & 0xFFFF );
+}
+
+void
+WireBuf::put_hdr(int type, int klass, int ttl, int rdlen){
+    put_short( type );
+    put_short( klass );
+    put_long(  ttl );
+    put_short( rdlen );
+}
+
+// placeholder, filled in at runtime
+void
+WireBuf::put_zptr(void){
+    zfix.push_back( data.length() );
+    put_short( 0 );
+}
+
+// append an RR, with its name
+void
+WireBuf::add_rr(const RR *r, bool isq){
+
+    if( isq ){
+        // NB: the question is always right after the header
+        put_short( 0xC000 + sizeof(DNS_Hdr) );
+    }else{
+        data.append( r->name_wire.data(), r->name_wire.length() );
+        put_zptr();
+    }
+
+    int base = data.length();
+    data.append( r->wire.data, r->wire.len );
+
+    for(int i=0; i<r->wire.nzfix; i++){
+        zfix.push_back( base + r->wire.zfix[i] );
+    }
+
+    count ++;
+    if( r->type == TYPE_NS ) has_ns = 1;
+}
+
+// copy into the arena
+void
+WireBuf::save(Arena *a, WireImg *w) const {
+
+    w->len    = data.length();
+    w->nzfix  = zfix.size();
+    w->count  = count;
+    w->has_ns = has_ns;
+
+    char *d = (char*)a->alloc( w->len );
+    memcpy(d, data.data(), w->len);
+    w->data = d;
+
+    if( w->nzfix ){
+        uint16_t *z = (uint16_t*)a->alloc( w->nzfix * sizeof(uint16_t) );
+        memcpy(z, &zfix[0], w->nzfix * sizeof(uint16_t));
+        w->zfix = z;
+    }
+}
+
+int
+WireImg::put(NTD *ntd) const {
+
+    if( ! ntd->space_avail(len) ) return 0;
+
+    uchar *d = ntd->respb.buf + ntd->respb.datalen;
+    memcpy(d, data, len);
+
+    int zp = 0xC000 + ntd->ztab.zpos;
+    for(int i=0; i<nzfix; i++){
+        d[ zfix[i]     ] = zp >> 8;
+        d[ zfix[i] + 1 ] = zp & 0xFF;
+    }
+
+    ntd->respb.datalen += len;
+    return 1;
+}
+
+//################################################################
+
+void
+RRCompString::render(WireBuf *w) const {
+
+    w->data.append( name_wire.data(), name_wire.length() );
+    w->put_zptr();
+}
+
 int
 RRCompString::find_ztab(NTD *ntd) const {
 
@@ -529,14 +659,14 @@ RRCompString::wire_len(NTD *ntd, int zpos) const {
 int
 RRCompString::put(NTD *ntd, int zpos) const {
 
-    ntd->respb.put_data((uchar*) name_wire.c_str(), name_wire.length());
+    ntd->respb.put_data((uchar*) name_wire.data(), name_wire.length());
 
     if( zpos ){
         ntd->respb.put_short( 0xC000 + zpos );	// ptr to zone
     }else if( dom_wire.length() ){
         // record domain in ztab
         ntd->ztab.add( domain.c_str(), ntd->respb.datalen );
-        ntd->respb.put_data((uchar*) dom_wire.c_str(), dom_wire.length());
+        ntd->respb.put_data((uchar*) dom_wire.data(), dom_wire.length());
     }
 
     return 1;
@@ -12,6 +12,7 @@
 #include "config.h"
 #include "dns.h"
 #include "zdb.h"
+#include "rcache.h"
 #include "version.h"
 
 #include <sys/socket.h>
@@ -28,7 +29,7 @@ ZDB *zdb = 0;
 void
 zdb_init(void){
 
-    if( !load_zdb() )
+    if( !load_zdb(0) )
         exit(1);
 }
 
@@ -38,63 +39,27 @@ zdb_init(void){
 RRSet::RRSet(Zone* z, string *l, bool wp){
 
     wildcard = wp;
-    name = *l;
     zone = z;
     delegation = 0;
+    name.set(z->arena, *l);
     if( l->empty() )
-        fqdn = zone->zonename;
+        fqdn.set(z->arena, zone->zonename);
     else
-        fqdn = name + "." + zone->zonename;
-}
-
-// s: foo.example.com
-// t:     example.com
-static bool
-match(const char *s, int sl, const char *t, int tl){
-
-    int so = sl - tl;
-    if( so < 0 ) return 0;
-    if( memcmp(s + so, t, tl) ) return 0;
-    if( !so ) return 1;		// exact match
-    if( s[so - 1] == '.' ) return 1;
-    return 0;
-}
-
-bool
-RRSet::wildmatch(const char *s, int l) const {
-
-    return match(s, l, fqdn.c_str(), fqdn.length());
-}
-
-bool
-Zone::zonematch(const char *s, int l) const {
-
-    return match(s, l, zonename.c_str(), zonename.length());
+        fqdn.set(z->arena, *l + "." + zone->zonename);
+    hash = zhash(fqdn.data(), fqdn.length());
 }
 
 //################################################################
 
 // add record to the zone
 int
-Zone::insert(ZDB *db, RR *rr, string *label){
+Zone::insert(RR *rr, string *label){
     bool wildp = rr->wildcard;
 
     // existing RRSet? add. else create new RRSet
     RRSet *rrs = find_rrset( label, wildp );
-    if( ! rrs ){
-        rrs = RRSet::make(this, label, wildp, rr->type);
-        if( ! rrs ){
-            BUG("create rrs failed! type %d", rr->type);
-            return 0;
-        }
-        rrset.push_back(rrs);
-
-        // delegated subdomains will be wired later (zdb::analyze)
-        if( ! rrs->delegation )
-            db->insert(rrs);
-
-        DEBUG("new RRSet wild %d, name %s, zone %s; fqdn %s", wildp, label->c_str(), zonename.c_str(), rrs->fqdn.c_str());
-    }
+    if( ! rrs ) rrs = new_rrset( label, wildp, rr->type );
+    if( ! rrs ) return 0;
 
     // glb RR + RRSet must match
     if( ! rrs->is_compat(rr) )
@@ -110,14 +75,48 @@ Zone::insert(ZDB *db, RR *rr, string *label){
     return 1;
 }
 
+RRSet *
+Zone::new_rrset(string *label, bool wildp, int type){
+
+    RRSet *rrs = RRSet::make(this, label, wildp, type);
+    if( ! rrs ){
+        BUG("create rrs failed! type %d", type);
+        return 0;
+    }
+    rrset.push_back(rrs);
+    byname.add(rrs);
+
+    DEBUG("new RRSet wild %d, name %s, zone %s; fqdn %s", wildp, label->c_str(), zonename.c_str(), rrs->fqdn.c_str());
+    return rrs;
+}
+
+// add a loaded zone + its rrsets to the db
+void
+ZDB::add_zone(Zone *z){
+
+    z->hold();
+    zone.push_back(z);
+
+    for(int i=0; i<(int)z->rrset.size(); i++){
+        RRSet *rrs = z->rrset[i];
+
+        // delegated subdomains will be wired later (zdb::analyze)
+        if( ! rrs->delegation )
+            insert(rrs, rrs->wildcard);
+    }
+
+    for(int i=0; i<(int)z->monitored.size(); i++)
+        add_monitored( z->monitored[i] );
+}
+
 // add a new rrset to the db
 int
-ZDB::insert(RRSet *rrs){
+ZDB::insert(RRSet *rrs, bool wild){
 
-    if( rrs->wildcard )
-        wildcard.push_back(rrs);
+    if( wild )
+        ltree.add_wild( rrs );
     else
-        rrset[ rrs->fqdn.c_str() ] = rrs;
+        rrset.add( rrs );
 
     return 1;
 }
@@ -126,18 +125,18 @@ RRSet *
 RRSet::make(Zone* z, string *l, bool wp, int type){
 
     if( (type & TYPE_COMPAT_MASK) == type ){
-        return new RRSet(z,l,wp);
+        return new(z->arena) RRSet(z,l,wp);
     }
 
     switch(type){
     case TYPE_GLB_RR:
-        return new RRSet_GLB_RR(z,l,wp);
+        return new(z->arena) RRSet_GLB_RR(z,l,wp);
     case TYPE_GLB_GEO:
-        return new RRSet_GLB_Geo(z,l,wp);
+        return new(z->arena) RRSet_GLB_Geo(z,l,wp);
     case TYPE_GLB_MM:
-        return new RRSet_GLB_MM(z,l,wp);
+        return new(z->arena) RRSet_GLB_MM(z,l,wp);
     case TYPE_GLB_Hash:
-        return new RRSet_GLB_Hash(z,l,wp);
+        return new(z->arena) RRSet_GLB_Hash(z,l,wp);
     default:
         return 0;
     }
@@ -169,20 +168,41 @@ RRSet_GLB_Hash::is_compat(RR *r) const {
 }
 
 
+// can the response be cached?
+bool
+RRSet::is_static() const {
+
+    for(int i=0; i<rr.size(); i++){
+        if( ! rr[i]->is_static() ) return 0;
+    }
+    return 1;
+}
+
 void
 RRSet::add_rr(RR *r){
-    rr.push_back(r);
+    rr.push_back(zone->arena, r);
     if( r->delegation ) delegation = 1;
 }
 
 //################################################################
 
 int
-Zone::analyze(ZDB *db){
+Zone::analyze(void){
 
     for(int i=0; i<rrset.size(); i++){
-        rrset[i]->analyze(this);
+        RRSet *rs = rrset[i];
+        rs->analyze(this);
+        if( rs->needs_wire_up() ) wired.push_back(rs);
     }
+
+    // pre-render the authority section, if we can
+    WireBuf auth;
+    for(int i=0; i<(int)ns.size(); i++){
+        if( ns[i]->wire.empty() ) return 1;
+        auth.add_rr(ns[i], 0);
+    }
+    auth.save(arena, &ns_auth);
+
     return 1;
 }
 
@@ -194,16 +214,50 @@ RRSet::analyze(Zone *z){
         r->analyze(z);
     }
 
+    // pre-render answers for each qtype, if there is nothing special here
+    if( ! is_static() ) return 1;
+
+    vector<int> types;
+
+    for(int i=0; i<rr.size(); i++){
+        RR *r = rr[i];
+        if( r->klass != CLASS_IN ) continue;
+        if( r->delegation || r->type == TYPE_CNAME || r->type == TYPE_ALIAS ) return 1;
+        if( r->wire.empty() ) return 1;
+        if( std::find(types.begin(), types.end(), r->type) == types.end() )
+            types.push_back( r->type );
+    }
+    types.push_back( TYPE_ANY );
+
+    for(int t=0; t<(int)types.size(); t++){
+        WireBuf buf;
+        WireImg img;
+        for(int i=0; i<rr.size(); i++){
+            RR *r = rr[i];
+            if( r->klass != CLASS_IN ) continue;
+            if( types[t] == TYPE_ANY || types[t] == r->type )
+                buf.add_rr(r, 1);
+        }
+        buf.save(z->arena, &img);
+        answer.push_back( z->arena, std::make_pair(types[t], img) );
+    }
+
     return 1;
 }
 
-// find + attach A+AAAA to NS+CNAME
+// pre-render, find + attach A+AAAA to NS+CNAME
 void
 RR_Compress::analyze(Zone *z){
 
-    if( type != TYPE_NS && type != TYPE_CNAME ) return;
     if( ! rrdata.same_zone ) return;
 
+    WireBuf w;
+    w.put_hdr(type, klass, ttl, rrdata.name_wire.length() + 2);
+    rrdata.render( &w );
+    w.save(z->arena, &wire);
+
+    if( type != TYPE_NS && type != TYPE_CNAME ) return;
+
     RRSet *rrs = z->find_rrset( & rrdata.name, 0 );
     if( ! rrs ) return;
 
@@ -212,7 +266,7 @@ RR_Compress::analyze(Zone *z){
         if( rr->klass != CLASS_IN ) continue;
         if( rr->type == TYPE_A || rr->type == TYPE_AAAA ){
             DEBUG("found addr for %s -> %s", name.c_str(), rrs->fqdn.c_str());
-            additional.push_back(rr);
+            additional.push_back(z->arena, rr);
         }
     }
 }
@@ -222,6 +276,12 @@ RR_MX::analyze(Zone *z){
 
     if( ! dest.same_zone ) return;
 
+    WireBuf w;
+    w.put_hdr(type, klass, ttl, dest.name_wire.length() + 4);
+    w.put_short( pref );
+    dest.render( &w );
+    w.save(z->arena, &wire);
+
     RRSet *rrs = z->find_rrset( & dest.name, 0 );
     if( ! rrs ) return;
 
@@ -230,11 +290,30 @@ RR_MX::analyze(Zone *z){
         if( rr->klass != CLASS_IN ) continue;
         if( rr->type == TYPE_A || rr->type == TYPE_AAAA ){
             DEBUG("found addr for %s -> %s", name.c_str(), rrs->fqdn.c_str());
-            additional.push_back(rr);
+            additional.push_back(z->arena, rr);
         }
     }
 }
 
+void
+RR_SOA::analyze(Zone *z){
+
+    if( ! mname.same_zone || ! rname.same_zone ) return;
+
+    WireBuf w;
+    w.put_hdr(type, klass, ttl, mname.name_wire.length() + rname.name_wire.length() + 24);
+    mname.render( &w );
+    rname.render( &w );
+    w.put_long( serial  );
+    w.put_long( refresh );
+    w.put_long( retry   );
+    w.put_long( expire  );
+    w.put_long( minimum );
+    w.save(z->arena, &wire);
+}
+
+// NB: the zone may be shared with the current zdb, which is still answering.
+// work in a local, set targ_rrs once
 void
 RR_Alias::wire_up(ZDB *db, Zone *z, RRSet *s){
 
@@ -243,6 +322,7 @@ RR_Alias::wire_up(ZDB *db, Zone *z, RRSet *s){
     if( ! rrs ) rrs = db->find_rrset( target.c_str() );
     if( !rrs ){
         PROBLEM("cannot locate ALIAS target %s => %s", s->fqdn.c_str(), target.c_str());
+        targ_rrs = 0;
         return;
     }
 
@@ -252,6 +332,7 @@ RR_Alias::wire_up(ZDB *db, Zone *z, RRSet *s){
         RR *r = rrs->rr[i];
         if( r->type == TYPE_ALIAS ){
             PROBLEM("cannot ALIAS => ALIAS (%s => %s)", s->fqdn.c_str(), target.c_str());
+            targ_rrs = 0;
             return;
         }
     }
@@ -271,11 +352,12 @@ zone_compare_length(Zone *a, Zone *b){
 // figure out what to do with delegated subdomains
 //   if we host it - ignore the rrs
 //   if we don't   - treat it as a wilcard + handle it
+// the zone may be shared with other zdbs. only this zdb is changed
 void
 Zone::wire_up(ZDB *db){
 
-    for(int i=0; i<rrset.size(); i++){
-        RRSet *rs = rrset[i];
+    for(int i=0; i<(int)wired.size(); i++){
+        RRSet *rs = wired[i];
 
         rs->wire_up(db, this);
 
@@ -284,17 +366,28 @@ Zone::wire_up(ZDB *db){
         Zone *z = db->find_zone( rs->fqdn.c_str() );
         DEBUG("subdomain %s => %x => %s", rs->fqdn.c_str(), z, z? z->zonename.c_str() : "");
 
-        if( z && z->zonename == rs->fqdn ){
+        if( z && rs->fqdn == z->zonename ){
             // ignore record
             DEBUG("subdomain %s is local", rs->fqdn.c_str());
         }else{
             DEBUG("wiring delegated subdomain %s", rs->fqdn.c_str());
-            rs->wildcard = 1;
-            db->insert(rs);
+            db->insert(rs, 1);
         }
     }
 }
 
+// anything that depends on the other zones?
+bool
+RRSet::needs_wire_up(void) const {
+
+    if( delegation ) return 1;
+
+    for(int i=0; i<rr.size(); i++){
+        if( rr[i]->type == TYPE_ALIAS ) return 1;
+    }
+    return 0;
+}
+
 void
 RRSet::wire_up(ZDB *db, Zone *z){
 
@@ -310,14 +403,22 @@ RRSet::wire_up(ZDB *db, Zone *z){
 int
 ZDB::analyze(){
 
+    rrset.build();
+
     // sort zones, longest first
     std::sort( zone.begin(), zone.end(), zone_compare_length );
 
+    for(int i=0; i<(int)zone.size(); i++){
+        ltree.add_zone( zone[i] );
+    }
+
     // wire NS delegations, etc
     for(int i=0; i<zone.size(); i++){
         zone[i]->wire_up(this);
     }
 
+    if( config->response_cache > 0 )
+        rcache = new RCache( config->response_cache );
 
     return 1;
 }
@@ -326,44 +427,253 @@ ZDB::analyze(){
 
 RRSet *
 Zone::find_rrset(string *s, bool wp) const {
+    return byname.find(s->data(), s->length(), wp);
+}
+
+RRSet *
+Zone::find_rrset(const AStr *s, bool wp) const {
+    return byname.find(s->data(), s->length(), wp);
+}
 
-    // only used while loading zone, no need for speed
+// keyed on the label only, wildcard is checked in find
+// (delegations are only in the zdb's label tree)
+void
+RRSetIndex::add(RRSet *r){
 
-    for(int i=0; i<rrset.size(); i++){
-        if( rrset[i]->wildcard == wp && rrset[i]->name == *s )
-            return rrset[i];
+    // keep the load factor <= 1/2
+    if( (count + 1) * 2 > mask + 1 ) grow();
+
+    uint32_t h = zhash(r->name.data(), r->name.length());
+    uint32_t p = h & mask;
+    while( tab[p].rrs ) p = (p + 1) & mask;
+
+    tab[p].hash = h;
+    tab[p].rrs  = r;
+    count ++;
+}
+
+void
+RRSetIndex::grow(void){
+    uint32_t n   = tab ? (mask + 1) * 2 : 64;
+    Ent     *old = tab;
+    uint32_t on  = tab ? mask + 1 : 0;
+
+    tab  = new Ent[ n ];
+    mask = n - 1;
+    memset(tab, 0, n * sizeof(Ent));
+
+    for(uint32_t i=0; i<on; i++){
+        if( !old[i].rrs ) continue;
+        uint32_t p = old[i].hash & mask;
+        while( tab[p].rrs ) p = (p + 1) & mask;
+        tab[p] = old[i];
+    }
+
+    delete [] old;
+}
+
+RRSet *
+RRSetIndex::find(const char *s, int l, bool wp) const {
+
+    if( !tab ) return 0;
+
+    uint32_t h = zhash(s, l);
+
+    for(uint32_t p = h & mask; tab[p].rrs; p = (p + 1) & mask){
+        const Ent *e = tab + p;
+        if( e->hash == h && e->rrs->wildcard == wp && e->rrs->name.length() == l
+            && !memcmp(e->rrs->name.data(), s, l) )
+            return e->rrs;
     }
+
     return 0;
 }
 
+void
+RRSetHash::build(void){
+
+    // keep the load factor <= 1/2
+    uint32_t n = 16;
+    while( n < all.size() * 2 ) n <<= 1;
+
+    delete [] tab;
+    tab  = new Ent[ n ];
+    mask = n - 1;
+    memset(tab, 0, n * sizeof(Ent));
+
+    for(int i=0; i<(int)all.size(); i++){
+        RRSet *r = all[i];
+        int l    = r->fqdn.length();
+        uint32_t h = r->hash;
+        uint32_t p = h & mask;
+
+        while( tab[p].rrs ){
+            // duplicate name, last one wins
+            if( tab[p].hash == h && tab[p].len == l && r->fqdn == tab[p].rrs->fqdn ) break;
+            p = (p + 1) & mask;
+        }
+
+        tab[p].hash = h;
+        tab[p].len  = l;
+        tab[p].rrs  = r;
+    }
+
+    DEBUG("rrset hash: %d names, %d slots", all.size(), n);
+}
+
 RRSet *
-ZDB::find_rrset(const char *s) const {
+RRSetHash::find(const char *s, int l, uint32_t h) const {
 
-    // rrset[ s ]
-    MapRRSet::const_iterator it = rrset.find( s );
-    if( it != rrset.end() ){
-        return it->second;
+    if( !tab ) return 0;
+
+    for(uint32_t p = h & mask; tab[p].rrs; p = (p + 1) & mask){
+        const Ent *e = tab + p;
+        if( e->hash == h && e->len == l && !memcmp(e->rrs->fqdn.data(), s, l) )
+            return e->rrs;
     }
 
-    // check wildcards
+    return 0;
+}
+
+RRSet *
+ZDB::find_rrset(const char *s) const {
     int l = strlen(s);
-    for(int i=0; i<wildcard.size(); i++){
-        if( wildcard[i]->wildmatch(s, l) ) return wildcard[i];
+    Zone *z;
+
+    return find_rrset(s, l, zhash(s, l), &z);
+}
+
+// s is lowercase, h = zhash(s)
+// also finds the zone, for the response
+RRSet *
+ZDB::find_rrset(const char *s, int l, uint32_t h, Zone **zp) const {
+    RRSet *rrs = rrset.find(s, l, h);
+
+    if( rrs ){
+        *zp = rrs->zone;
+        return rrs;
     }
 
-    return 0;
+    // check wildcards + delegations
+    ltree.find(s, l, zp, &rrs);
+    if( rrs ) *zp = rrs->zone;
+
+    return rrs;
 }
 
 Zone *
 ZDB::find_zone(const char *s) const {
+    Zone *z;
+    RRSet *rrs;
 
-    int l = strlen(s);
-    for(int i=0; i<zone.size(); i++){
-        if( zone[i]->zonematch(s, l) ) return zone[i];
+    ltree.find(s, strlen(s), &z, &rrs);
+    return z;
+}
+
+//################################################################
+
+static int
+label_cmp(const string *a, const char *b, int bl){
+    int al = a->length();
+    int c  = memcmp(a->data(), b, MIN(al, bl));
+
+    if( c ) return c;
+    return al - bl;
+}
+
+// binary search the kids
+LabelTree::Node *
+LabelTree::child(const Node *n, const char *s, int l) const {
+    int lo = 0, hi = n->kids.size() - 1;
+
+    while( lo <= hi ){
+        int m = (lo + hi) / 2;
+        int c = label_cmp( & n->kids[m]->label, s, l );
+        if( !c ) return n->kids[m];
+        if( c < 0 )
+            lo = m + 1;
+        else
+            hi = m - 1;
     }
+
     return 0;
 }
 
+// find or create the node for a fqdn
+LabelTree::Node *
+LabelTree::node(const string *fqdn){
+    const char *s = fqdn->c_str();
+    int e = fqdn->length();
+    Node *n = & root;
+
+    if( e && s[e-1] == '.' ) e --;
+
+    while( e > 0 ){
+        int b = e;
+        while( b > 0 && s[b-1] != '.' ) b --;
+
+        Node *k = child(n, s + b, e - b);
+        if( !k ){
+            k = new Node;
+            k->label.assign(s + b, e - b);
+
+            vector<Node*>::iterator it = n->kids.begin();
+            while( it != n->kids.end() && label_cmp(& (*it)->label, s + b, e - b) < 0 ) it ++;
+            n->kids.insert(it, k);
+        }
+
+        n = k;
+        e = b - 1;
+    }
+
+    return n;
+}
+
+void
+LabelTree::add_zone(Zone *z){
+    Node *n = node( & z->zonename );
+
+    if( !n->zone ) n->zone = z;
+}
+
+void
+LabelTree::add_wild(RRSet *rrs){
+    string fqdn = rrs->fqdn.str();
+    Node *n = node( & fqdn );
+
+    if( !n->wild ) n->wild = rrs;
+}
+
+// walk down from the root, remember the deepest zone + wildcard
+void
+LabelTree::find(const char *s, int e, Zone **zp, RRSet **wp) const {
+    const Node *n = & root;
+
+    *zp = n->zone;
+    *wp = n->wild;
+
+    if( e && s[e-1] == '.' ) e --;
+
+    while( e > 0 ){
+        int b = e;
+        while( b > 0 && s[b-1] != '.' ) b --;
+
+        n = child(n, s + b, e - b);
+        if( !n ) break;
+
+        if( n->zone ) *zp = n->zone;
+        if( n->wild ) *wp = n->wild;
+        e = b - 1;
+    }
+}
+
+LabelTree::Node::~Node(){
+
+    for(int i=0; i<(int)kids.size(); i++){
+        delete kids[i];
+    }
+}
+
 //################################################################
 
 void
@@ -388,12 +698,38 @@ Zone::~Zone(){
         RRSet *r = rrset[i];
         delete r;
     }
+
+    // after the RRSets, their memory is in here
+    delete arena;
 }
 
 ZDB::~ZDB(){
 
+    delete rcache;
+
+    // zones may be shared with the next zdb
     for(int i=0; i<zone.size(); i++){
         Zone *z = zone[i];
-        delete z;
+        if( z->release() ) delete z;
+    }
+}
+
+// the reload thread adds, the epoch reaper releases
+void
+Zone::hold(void){
+
+    while(1){
+        uint32_t r = refs;
+        if( ATOMIC_CAS32(refs, r, r + 1) ) return;
+    }
+}
+
+// true if this was the last reference
+bool
+Zone::release(void){
+
+    while(1){
+        uint32_t r = refs;
+        if( ATOMIC_CAS32(refs, r, r - 1) ) return r == 1;
     }
 }
@@ -10,60 +10,183 @@
 #include "defs.h"
 #include "misc.h"
 #include "diag.h"
+#include "lock.h"
 #include "config.h"
 #include "dns.h"
 #include "zdb.h"
 #include "mmd.h"
 #include "mon.h"
 #include "version.h"
+#include "epoch.h"
 
 #include <sys/socket.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 //################################################################
 
+// the whole file is read into memory, and scanned in place
 class InputF {
 public:
-    FILE 	*f;
     string 	*name;
     int 	line;
+    char	*buf;
+    const char	*p;		// next unread char
+    const char	*end;
 
-    InputF(string *n, FILE *fp){ name = n; f = fp; line = 0; }
-    int inline nextc(){
-        int c = getc(f);
-        if( c == '\n' ) line ++;
-        return c;
-    }
+    InputF(string *n){ name = n; line = 0; buf = 0; p = end = 0; }
+    ~InputF(){ delete [] buf; }
+    int read_file(void);
     void problem(const char *msg) const {
         PROBLEM("ERROR file %s line %d: %s", name->c_str(), line, msg);
     }
 };
 
+// not mmap: a zone file truncated in place while we read it would SIGBUS
+int
+InputF::read_file(void){
+    struct stat sb;
+
+    int fd = open(name->c_str(), O_RDONLY);
+    if( fd == -1 ) return 0;
+
+    if( fstat(fd, &sb) == -1 ){
+        close(fd);
+        return 0;
+    }
+
+    buf = new char[ sb.st_size ];
+    int64_t len = 0;
+
+    while( len < sb.st_size ){
+        ssize_t r = read(fd, buf + len, sb.st_size - len);
+        if( r == -1 && errno == EINTR ) continue;
+        if( r <= 0 ) break;
+        len += r;
+    }
+    close(fd);
+
+    if( len < sb.st_size ) return 0;
+
+    p   = buf;
+    end = buf + len;
+    return 1;
+}
+
 // ################################################################
 
-int
-load_zdb(){
-    ZDB *z;
+// zone files are parsed in parallel, each into its own Zone,
+// then added to the db in config order. all or nothing.
+// zones that have not changed are taken from the old db, not reloaded.
 
-    z = new ZDB;
+class Zone_Loader {
+public:
+    vector<ZoneConf*>	conf;
+    vector<Zone*>	zone;
+    vector<bool>	reused;
+    int			next;
+    volatile bool	failed;
+    Mutex		lock;
+};
 
-    // load zones
-    Zone_List::iterator final = config->zones.end(), it;
+static void *
+zone_load_worker(void *x){
+    Zone_Loader *zl = (Zone_Loader*)x;
+
+    while( ! zl->failed ){
+        zl->lock.lock();
+        int i = zl->next ++;
+        zl->lock.unlock();
+
+        if( i >= (int)zl->conf.size() ) break;
+        if( zl->zone[i] ) continue;		// reused
 
-    for(it=config->zones.begin(); it != final; it++){
-	ZoneConf *zc = *it;
-        int ok = z->load(& zc->zone, & zc->file);
+        ZoneConf *zc = zl->conf[i];
+        Zone *z = ZDB::load_zone(& zc->zone, & zc->file);
 
-        if( !ok ){
+        if( !z ){
             PROBLEM("error loading zone %s from %s - aborting load", zc->zone.c_str(), zc->file.c_str());
-            delete z;
-            return 0;
+            zl->failed = 1;
+            break;
+        }
+
+        zl->zone[i] = z;
+    }
+
+    return 0;
+}
+
+static int
+load_zones(ZDB *db, const ZDB *old){
+    Zone_Loader zl;
+
+    zl.conf.assign( config->zones.begin(), config->zones.end() );
+    zl.zone.resize( zl.conf.size(), 0 );
+    zl.reused.resize( zl.conf.size(), 0 );
+    zl.next    = 0;
+    zl.failed  = 0;
+
+    int nload = zl.conf.size();
+    if( old ){
+        for(int i=0; i<(int)zl.conf.size(); i++){
+            zl.zone[i] = old->find_zone_conf( zl.conf[i] );
+            if( !zl.zone[i] ) continue;
+            zl.reused[i] = 1;
+            nload --;
+        }
+        DEBUG("%d zones unchanged, %d to load", zl.conf.size() - nload, nload);
+    }
+
+    int nthr = config->load_threads;
+    if( nthr > nload ) nthr = nload;
+
+    // this thread works too
+    vector<pthread_t> tid;
+    for(int i=1; i<nthr; i++){
+        pthread_t t;
+        int err = pthread_create(&t, 0, zone_load_worker, &zl);
+        if( err ){
+            PROBLEM("cannot create thread: %d", err);
+            break;
         }
+        tid.push_back(t);
+    }
+
+    DEBUG("loading %d zones with %d threads", nload, tid.size() + 1);
+
+    zone_load_worker( &zl );
+
+    for(int i=0; i<(int)tid.size(); i++)
+        pthread_join(tid[i], 0);
+
+    // on failure, the caller discards the db, and whatever did load with it
+    for(int i=0; i<(int)zl.zone.size(); i++){
+        Zone *z = zl.zone[i];
+        if( ! z ) continue;
+        db->add_zone( z );
+        if( ! zl.failed && ! zl.reused[i] ) VERBOSE("loaded zone %s", zl.conf[i]->zone.c_str());
+    }
+
+    return ! zl.failed;
+}
 
-        VERBOSE("loaded zone %s", zc->zone.c_str());
+// reuse: keep unchanged zones from the current db
+int
+load_zdb(bool reuse){
+    ZDB *z;
+    ZDB *old = zdb;
+
+    z = new ZDB;
+
+    // load zones
+    if( ! load_zones(z, reuse ? old : 0) ){
+        delete z;
+        return 0;
     }
 
     if( ! z->analyze() ){
@@ -72,125 +195,219 @@ load_zdb(){
         return 0;
     }
 
-    // replace old db
-    ZDB *old = zdb;
+    // probes keep their state + schedule across the reload
+    mon_carry_over( old ? &old->monitored : 0, &z->monitored );
+
+    // replace old db. not while the mon process is being started
+    mon_lock();
     ATOMIC_SETPTR( zdb, z );
+    mon_unlock();
 
-    mon_restart();
+    // tell the monitor what changed
+    mon_reload();
 
-    if( old ){
-        sleep(2);
-        delete old;
-    }
+    if( old ) epoch_retire(old);
 
     return 1;
 }
 
+// load + return one zone, without touching any db
+// (runs in the zone loader threads)
+Zone *
+ZDB::load_zone(string *zonename, string *file){
 
-int
-ZDB::load(string *zonename, string *file){
+    struct stat st;
+
+    // remember what we loaded, so a reload can tell if it changed
+    if( stat(file->c_str(), &st) == -1 ){
+        PROBLEM("cannot stat zone file %s: %s", file->c_str(), strerror(errno));
+        return 0;
+    }
 
     DEBUG("loading zone %s from %s", zonename->c_str(), file->c_str());
 
-    // open file
-    FILE *f = fopen(file->c_str(), "r");
-    if( !f ){
-        PROBLEM("cannot open zone file %s", file->c_str());
+    InputF ff(file);
+    if( ! ff.read_file() ){
+        PROBLEM("cannot read zone file %s", file->c_str());
         return 0;
     }
 
-    InputF ff(file, f);
     Zone *z = new Zone(zonename, file);
-    int ok = z->load(this, &ff);
 
-    fclose(f);
-
-    if( !ok ){
+    if( ! z->load(&ff) ){
         delete z;
         return 0;
     }
 
-    zone.push_back(z);
+    z->set_src(&st);
+    return z;
+}
 
-    return 1;
+void
+Zone::set_src(const struct stat *sb){
+
+    src_mtime = sb->st_mtime;
+    src_size  = sb->st_size;
+    src_ino   = sb->st_ino;
+}
+
+// same file, not modified since we loaded it?
+bool
+Zone::unchanged(const ZoneConf *zc) const {
+    struct stat sb;
+
+    if( zonefile != zc->file ) return 0;
+    if( stat(zonefile.c_str(), &sb) == -1 ) return 0;
+
+    return sb.st_mtime == src_mtime && sb.st_size == src_size && (int64_t)sb.st_ino == src_ino;
+}
+
+// the zone for zc, if it can be reused as is
+Zone *
+ZDB::find_zone_conf(const ZoneConf *zc) const {
+
+    Zone *z = find_zone( zc->zone.c_str() );
+    if( !z ) return 0;
+
+    // closest enclosing zone. we need the exact one
+    if( z->zonename.length() != zc->zone.length() + 1 ) return 0;
+    if( z->zonename.compare(0, zc->zone.length(), zc->zone) ) return 0;
+
+    if( ! z->unchanged(zc) ){
+        DEBUG("zone %s changed", zc->zone.c_str());
+        return 0;
+    }
+
+    return z;
 }
 
 
+// character classes for get_line
+#define ZC_TEXT		0
+#define ZC_SPACE	1
+#define ZC_NL		2
+#define ZC_SPECIAL	3	// ; " ( ) { }
+
+static class ZChar {
+public:
+    uchar cl[256];
+    ZChar(){
+        for(int c=0; c<256; c++)
+            cl[c] = isspace(c) ? ZC_SPACE : ZC_TEXT;
+        cl['\n'] = ZC_NL;
+        cl[';'] = cl['"'] = cl['('] = cl[')'] = cl['{'] = cl['}'] = ZC_SPECIAL;
+    }
+} zchar;
+
+// join continued lines, remove comments, collapse whitespace
 // 1 = ok, 0 = eof, -1 = uhoh
 static int
 get_line(InputF *f, string *line){
-    int parens   = 0;
-    int allspace = 1;
-    int prev     = 0;
+    const char *p   = f->p;
+    const char *end = f->end;
+    int parens      = 0;
+    int allspace    = 1;
+    int space       = 0;	// last char added was a space
 
     line->clear();
 
     while(1){
-        int c = f->nextc();
-    redo:
-        if( c == -1 ){
+        if( p >= end ){
+            f->p = p;
             if( !line->empty() ){
                 f->problem("unexpected eof");
                 return -1;
             }
             return 0;
         }
-        if( c == ';' ){
-            // eat to end of line
-            while( c != '\n' && c != -1 ) c = f->nextc();
-            goto redo;
-        }
-        if( c == '"' ){
-            // XXX - handle \"
-            // until "
-            do {
-                line->push_back(c);
-                c = f->nextc();
-            } while( c != '"' && c != -1 );
-            // fall through
+
+        const char *s = p;
+
+        switch( zchar.cl[(uchar)*p] ){
+        case ZC_TEXT:
+            // usually, the rest of the line, single spaced
+            while(1){
+                while( ++p < end && zchar.cl[(uchar)*p] == ZC_TEXT ) ;
+                if( p + 1 < end && *p == ' ' && zchar.cl[(uchar)p[1]] == ZC_TEXT ) continue;
+                break;
+            }
+            line->append(s, p - s);
+            allspace = 0;
+            space    = 0;
+            continue;
+
+        case ZC_SPACE:
+            while( ++p < end && zchar.cl[(uchar)*p] == ZC_SPACE ) ;
+            if( !space ) line->push_back(' ');
+            space = 1;
+            continue;
+
+        case ZC_NL:
+            f->line ++;
+            p ++;
+            if( parens ) continue;
+            if( line->empty() ) continue;
+            if( allspace ){
+                line->clear();
+                space = 0;
+                continue;
+            }
+            f->p = p;
+            return 1;
         }
 
-        if( c == '(' ){
+        // special
+        switch( *p ){
+        case ';':
+            // eat to end of line
+            p = (const char*)memchr(p, '\n', end - p);
+            if( !p ) p = end;
+            continue;
+
+        case '"': {
+            // XXX - handle \"
+            // until ", as is
+            const char *q = (const char*)memchr(p + 1, '"', end - p - 1);
+            if( !q ) q = end;
+            for(const char *n=p; (n = (const char*)memchr(n, '\n', q - n)); n++) f->line ++;
+            line->append(p, q - p);
+            p = q;
+            if( p >= end ) continue;	// unexpected eof
+            break; }
+
+        case '(':
             parens ++;
+            p ++;
             continue;
-        }
-        if( c == ')' ){
+
+        case ')':
             if( !parens ){
+                f->p = p;
                 f->problem("unexpected )");
                 return -1;
             }
             parens --;
+            p ++;
             continue;
-        }
-        if( c == '{' ){
+
+        case '{':
             parens ++;
-            // fall through
-        }
-        if( c == '}' ){
+            break;
+
+        case '}':
             if( parens != 1 ){
+                f->p = p;
                 f->problem("unexpected }");
                 return -1;
             }
             parens --;
-            // fall through
-        }
-        if( c == '\n' ){
-            if( parens ) continue;
-            if( line->empty() ) continue;
-            if( allspace ){
-                line->clear();
-                continue;
-            }
-            return 1;
+            break;
         }
 
-        // collapse multiple spaces
-        if( prev && isspace(c) && isspace(prev) ) continue;
-        if( isspace(c) ) c = ' '; // convert to spaces
-        else allspace = 0;
-
-        line->push_back(c);
-        prev = c;
+        // closing ", { or }
+        line->push_back(*p++);
+        allspace = 0;
+        space    = 0;
     }
 }
 
@@ -229,18 +446,21 @@ static int
 parse_class(InputF *f, string *line, int len, int *i, int *klass){
 
     if( *i >= len ) return 1;
+    const char *tok = line->data() + *i;
 
-    if( ! line->compare(*i, 2, "IN") ){
+    if( len - *i >= 2 && tok[0] == 'I' && tok[1] == 'N' ){
         *i += 3;
         *klass = CLASS_IN;
+        if( *i >= len ) return 1;
+        tok = line->data() + *i;
     }
 
-    if( ! line->compare(*i, 2, "CH") ){
+    if( len - *i >= 2 && tok[0] == 'C' && tok[1] == 'H' ){
         f->problem("class CH is not supported. so sorry.");
         return 0;
     }
 
-    if( ! line->compare(*i, 2, "HS") ){
+    if( len - *i >= 2 && tok[0] == 'H' && tok[1] == 'S' ){
         f->problem("class HS is not supported. so sorry.");
         return 0;
     }
@@ -271,12 +491,16 @@ static int
 parse_type(InputF *f, string *line, int len, int *i, int *type){
 
     if( *i >= len ) return 1;
-    const char *tok = line->c_str() + *i;
+    const char *tok = line->data() + *i;
+    int e = line->find(' ', *i);
+
+    // must be followed by rdata
+    if( e != -1 ){
+        int tl = e - *i;
 
-    for(int t=0; t<ELEMENTSIN(type_name); t++){
-        if( !strncmp(tok, type_name[t].name, type_name[t].len) ){
-            if( *i + 1 < len && isspace(tok[type_name[t].len])){
-                *i += type_name[t].len + 1;
+        for(int t=0; t<(int)ELEMENTSIN(type_name); t++){
+            if( type_name[t].len == tl && !memcmp(tok, type_name[t].name, tl) ){
+                *i += tl + 1;
                 *type = type_name[t].value;
                 return 1;
             }
@@ -292,10 +516,10 @@ parse_word(InputF *f, string *src, int *pos, string *dst){
 
     int ew = src->find(' ', *pos);
     if( ew == -1 ){
-        dst->assign( src->substr(*pos) );
+        dst->assign( *src, *pos, string::npos );
         *pos = src->length();
     }else{
-        dst->assign( src->substr(*pos, ew-*pos) );
+        dst->assign( *src, *pos, ew-*pos );
         *pos = ew + 1;
     }
 
@@ -313,13 +537,13 @@ parse_rest(InputF *f, string *line, int len, int *i, string *rdata, string *extr
             f->problem("unbalanced }");
             return 0;
         }
-        rdata->assign( line->substr(*i,p-*i-1) );	// and remove the space
-        extra->assign( line->substr(p) );
+        rdata->assign( *line, *i, p-*i-1 );	// and remove the space
+        extra->assign( *line, p, string::npos );
     }else{
         if( isspace(line->at(len-1)) )
-            rdata->assign( line->substr(*i, len-*i-1) );
+            rdata->assign( *line, *i, len-*i-1 );
         else
-            rdata->assign( line->substr(*i) );
+            rdata->assign( *line, *i, string::npos );
         extra->clear();
     }
 
@@ -336,10 +560,12 @@ parse_line(InputF *f, string *line, /* out: */ string *label, int *ttl, int *kla
 
     // label
     if( !isspace(line->at(i)) ){
-        label->clear();
-        for( ; i<len; i++){
-            if( isspace(line->at(i)) ) break;
-            label->push_back( tolower(line->at(i)) );
+        i = line->find(' ');
+        if( i == -1 ) i = len;
+        label->assign( *line, 0, i );
+        for(int l=0; l<i; l++){
+            char c = (*label)[l];
+            if( c >= 'A' && c <= 'Z' ) (*label)[l] = c + 'a' - 'A';
         }
 
         if( label->at( label->length() - 1 ) == '.' ){
@@ -364,25 +590,29 @@ parse_line(InputF *f, string *line, /* out: */ string *label, int *ttl, int *kla
 }
 
 static int
-parse_probe(ZDB *db, RR *rr, InputF *f, string *rdata, string *extra){
+parse_probe(vector<RR*> *monitored, RR *rr, InputF *f, string *rdata, string *extra){
     string freqs;
     string prog;
     string args;
     int freq = 0;
 
     // remove "{ " + " }"
-    if( extra->length() > 1 && extra->at(0) == '{' )   extra->erase(0,1);
-    if( extra->length() > 1 && isspace(extra->at(0)) ) extra->erase(0,1);
-    if( extra->length() > 1 && extra->at(extra->length() - 1) == '}' )   extra->erase(extra->length() - 1);
-    if( extra->length() > 1 && isspace(extra->at(extra->length() - 1)) ) extra->erase(extra->length() - 1);
+    int s = 0;
+    int e = extra->length();
 
+    if( e - s > 1 && extra->at(s) == '{' )     s ++;
+    if( e - s > 1 && isspace(extra->at(s)) )   s ++;
+    if( e - s > 1 && extra->at(e - 1) == '}' ) e --;
+    if( e - s > 1 && isspace(extra->at(e - 1)) ) e --;
+
+    string spec(*extra, s, e - s);
     int pos = 0;
-    int len = extra->length();
+    int len = spec.length();
 
-    DEBUG("probe [%s] len %d", extra->c_str(), len);
+    DEBUG("probe [%s] len %d", spec.c_str(), len);
 
-    if( pos < len && isdigit(extra->at(pos)) ){
-        if( parse_word(f, extra, &pos, &freqs) ){
+    if( pos < len && isdigit(spec.at(pos)) ){
+        if( parse_word(f, &spec, &pos, &freqs) ){
             freq = atoi( freqs.c_str() );
         }
     }
@@ -391,7 +621,7 @@ parse_probe(ZDB *db, RR *rr, InputF *f, string *rdata, string *extra){
         return 0;
     }
 
-    if( pos >= len || ! parse_word(f, extra, &pos, &prog) ){
+    if( pos >= len || ! parse_word(f, &spec, &pos, &prog) ){
         f->problem("invalid probe spec: expected type");
         return 1;
     }
@@ -399,16 +629,18 @@ parse_probe(ZDB *db, RR *rr, InputF *f, string *rdata, string *extra){
     // remove trailing " }"
     DEBUG("pos %d, len %d", pos, len);
     if( pos < len )
-        args = extra->substr(pos, len - pos);
+        args.assign( spec, pos, len - pos );
 
     DEBUG("probe %d %s, %s.", freq, prog.c_str(), args.c_str());
 
     rr->add_probe( new Monitor(freq, rdata, &prog, &args) );
-    db->add_monitored( rr );
+    monitored->push_back( rr );
+
+    return 1;
 }
 
 int
-Zone::load(ZDB *db, InputF *f){
+Zone::load(InputF *f){
     string line;
     string label;
     string rdata;
@@ -449,32 +681,49 @@ Zone::load(ZDB *db, InputF *f){
             }
         }
 
-        DEBUG("label: %s, ttl: %d, class: %d, type: %d, wild: %d", label.c_str(), ttl, klass, type, wildp);
-        DEBUG("rdata: %s; extra: %s", rdata.c_str(), extra.c_str());
-
-        // create rr
-        RR *rr = RR::make(&label, klass, type, ttl, wildp);
-        if( !rr ){
-            f->problem("cannot create rr");
+        if( ! add_record(f, &label, wildp, ttl, klass, type, &rdata, &extra) )
             return 0;
-        }
-        if( rr->configure(f, this, &rdata) ){
-            f->problem("cannot parse rdata");
-            delete rr;
-            return 0;
-        }
+    }
 
-        if( extra.length() ){
-            if( ! parse_probe(db, rr, f, &rdata, &extra ) )
-                return 0;
-        }
+    return finish_load(f);
+}
+
+// create the rr, add it to the zone
+int
+Zone::add_record(InputF *f, string *label, bool wildp, int ttl, int klass, int type,
+                 string *rdata, string *extra){
+
+    DEBUG("label: %s, ttl: %d, class: %d, type: %d, wild: %d", label->c_str(), ttl, klass, type, wildp);
+    DEBUG("rdata: %s; extra: %s", rdata->c_str(), extra->c_str());
+
+    // create rr
+    RR *rr = RR::make(arena, label, klass, type, ttl, wildp);
+    if( !rr ){
+        f->problem("cannot create rr");
+        return 0;
+    }
+    if( rr->configure(f, this, rdata) ){
+        f->problem("cannot parse rdata");
+        delete rr;
+        return 0;
+    }
 
-        if( !insert(db, rr, &label) ){
-            f->problem("unable to insert RR, not compitble with RRSet");
+    if( extra->length() ){
+        if( ! parse_probe(&monitored, rr, f, rdata, extra ) )
             return 0;
-        }
     }
 
+    if( !insert(rr, label) ){
+        f->problem("unable to insert RR, not compitble with RRSet");
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+Zone::finish_load(InputF *f){
+
     if( ! soa ){
         f->problem("SOA missing");
         return 0;
@@ -487,16 +736,16 @@ Zone::load(ZDB *db, InputF *f){
     // RSN - more sanity checks
 
 
-    if( !analyze(db) ){
+    if( !analyze() ){
         f->problem("zone failed to properly load");
         return 0;
     }
 
+    arena->done_loading();
 
     return 1;
 }
 
-
 // ################################################################
 
 // mname rname serial refresh retry expire min
@@ -505,11 +754,11 @@ RR_SOA::configure(InputF *f, Zone *z, string *rspec){
 
     int emn = rspec->find(' ');
     if( emn == -1 ){ f->problem("invalid SOA mname"); return 1; }
-    mname.set_name( rspec->substr(0, emn), &z->zonename );
+    mname.set_name( z->arena, rspec->substr(0, emn), &z->zonename );
 
     int ern = rspec->find(' ', emn+1);
     if( ern == -1 ){ f->problem("invalid SOA rname"); return 1; }
-    rname.set_name( rspec->substr(emn+1, ern-emn-1), &z->zonename );
+    rname.set_name( z->arena, rspec->substr(emn+1, ern-emn-1), &z->zonename );
 
     int len = rspec->length();
     int pos = ern + 1;
@@ -546,7 +795,7 @@ RR_MX::configure(InputF *f, Zone *z, string *rspec){
     int ep = rspec->find(' ');
     if( ep == -1 ){ f->problem("invalid MX"); return 1; }
 
-    dest.set_name( rspec->substr(ep+1), &z->zonename );
+    dest.set_name( z->arena, rspec->substr(ep+1), &z->zonename );
 
     return 0;
 }
@@ -666,6 +915,7 @@ RR_GLB_MM::configure(InputF *f, Zone *z, string *rspec){
         PROBLEM("ERROR file %s line %d: invalid datacenter'%s'", f->name->c_str(), f->line, datacenter.c_str());
         return 1;
     }
+    dcid = dc_id( datacenter.c_str() );
 
     if( pos < rspec->length() && isdigit(rspec->at(pos)) ){
         if( parse_word(f, rspec, &pos, &wtspec) ){
@@ -692,6 +942,8 @@ RR_GLB_MM::configure(InputF *f, Zone *z, string *rspec){
                 PROBLEM("ERROR file %s line %d: invalid failover '%s'",
                         f->name->c_str(), f->line, failover_name.c_str());
                 return 1;
+            }else{
+                failover_dcid = dc_id( failover_name.c_str() );
             }
         }
 